@@ -1,4 +1,6 @@
 #include "app.hpp"
+#include "sampling.hpp"
+#include "sampletables.hpp"
 
 #include <iostream>
 #include <sstream>
@@ -7,6 +9,15 @@
 
 using namespace glm;
 
+// std140 layout of the Material block (see assets/material.part)
+struct MaterialBlock {
+    vec3 F0;
+    float roughness;
+    vec3 kd;
+    float gamma;
+};
+static_assert(sizeof(MaterialBlock) == 32, "Material block doesn't match std140 layout");
+
 vec3 toVec3(const std::string& str)
 {
     std::stringstream ss(str);
@@ -15,34 +26,40 @@ vec3 toVec3(const std::string& str)
     return result;
 }
 
-// Returns a value in [0, 1), inverting digits. See pharr10.
-float getRadicalInverse(int n, int base)
+// Average red of the pixels with alpha (diagnostics, see mesh.fs), in [0, 1]
+float getCoveredAverage(const std::vector<u8>& pixels)
 {
-    assert(n > 0 && base > 1);
-
-    float value = 0.f;
-    float invBase = 1.f / base;
-    float invBi = invBase;
-    while (n > 0) {
-        int r  = n % base;
-        value += r * invBi;
-        invBi *= invBase;
-        n     /= base;
+    u64 sum = 0;
+    int covered = 0;
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+        if (pixels[i+3] > 0) {
+            sum += pixels[i];
+            covered++;
+        }
     }
-
-    return value;
+    if (covered == 0)
+        return 0.f;
+    return static_cast<float>(sum) / (255.f * covered);
 }
 
-vec3 importanceSampleTrowbridgeReitz(vec2 e12, float roughness)
+// Root mean square difference of RGB over pixels covered in both, 8-bit units
+float getCoveredError(const std::vector<u8>& pixels, const std::vector<u8>& reference)
 {
-    const float a = roughness;
-    const float phi = 2.f*PI*e12.x;
-    const float cosTheta = std::sqrt((1.f - e12.y) / (1.f + (a*a-1.f)*e12.y));
-    const float sinTheta = std::sqrt(1.f - cosTheta*cosTheta);
-
-    return vec3(sinTheta * std::cos(phi),
-                sinTheta * std::sin(phi),
-                cosTheta);
+    assert(pixels.size() == reference.size());
+    double sum = 0.0;
+    int count = 0;
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+        if (pixels[i+3] > 0 and reference[i+3] > 0) {
+            for (int c = 0; c < 3; c++) {
+                const double d = static_cast<double>(pixels[i+c]) - reference[i+c];
+                sum += d*d;
+            }
+            count += 3;
+        }
+    }
+    if (count == 0)
+        return 0.f;
+    return static_cast<float>(std::sqrt(sum / count));
 }
 
 void App::setValue(const std::string& param, const std::string& value)
@@ -59,28 +76,523 @@ void App::setValue(const std::string& param, const std::string& value)
         currentMeshInd = (value == "Walt")? 0 : 1;
     else if (param == "numSamples")
         numSamples = std::stoi(value);
+    else if (param == "targetError")
+        targetError = std::stof(value);
+    else if (param == "blueNoise")
+        blueNoise = (value == "1");
+    else if (param == "gpuSamples") {
+        gpuSamples = (value == "1");
+        if (gpuSamples and !renderer->getCaps().fragmentHighp) {
+            std::cout << "GPU sampling requires highp fragment shaders!" << std::endl;
+            gpuSamples = false;
+        }
+    }
+    else if (param == "vndf") {
+        vndf = (value == "1");
+        if (vndf and !renderer->getCaps().fragmentHighp) {
+            std::cout << "VNDF sampling requires highp fragment shaders!" << std::endl;
+            vndf = false;
+        }
+    }
+    else if (param == "mode") {
+        if (value == "splitSum")
+            shadingMode = ShadingMode::SplitSum;
+        else if (value == "filteredIS")
+            shadingMode = ShadingMode::FilteredIS;
+        else
+            std::cout << "Unknown mode " << value << "!" << std::endl;
+        if (shadingMode == ShadingMode::SplitSum and dfgLut == -1)
+            createDfgLut();
+    }
+    else if (param == "environment") {
+        const EnvironmentFormat previous = environmentFormat;
+        if (value == "octahedral")
+            environmentFormat = EnvironmentFormat::Octahedral;
+        else if (value == "panorama")
+            environmentFormat = EnvironmentFormat::Panorama;
+        else if (value == "cubemap") {
+            if (renderer->getCaps().textureLod)
+                environmentFormat = EnvironmentFormat::Cubemap;
+            else
+                std::cout << "Cubemap environment requires explicit lod lookups in shaders!" << std::endl;
+        }
+        else
+            std::cout << "Unknown environment " << value << "!" << std::endl;
+        if (environmentFormat == EnvironmentFormat::Octahedral and envOctahedral == -1)
+            loadOctahedralMap();
+        // 6 mips of 6 faces, e.g. from cmft, 256x256 on level 0 (see assets/cubemap.part)
+        if (environmentFormat == EnvironmentFormat::Cubemap and envCubemap == -1)
+            envCubemap = renderer->addCubemap("assets/cubemap", PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+        // The GPU filtered split-sum map is built from it too
+        if (environmentFormat != previous)
+            prefilteredLod = -1.f;
+    }
+    else if (param == "prefilteredMap") {
+        // Same layout as the GPU filtered map, see createPrefilteredMap
+        prefilteredMap = renderer->addTexture(value, PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        prefilteredBaked = true;
+    }
+    else if (param == "sampleBank") {
+        sampleBank = (value == "1");
+        if (sampleBank and sampleBankTexture == -1) {
+            std::cout << "Sample bank requires float textures!" << std::endl;
+            sampleBank = false;
+        }
+    }
     else if (param == "lod")
         lod = std::stof(value);
+    else if (param == "grid") {
+        std::stringstream ss(value);
+        ss >> gridColumns >> gridRows;
+        if (gridColumns > 0 and !renderer->getCaps().instancing) {
+            std::cout << "Material grid requires instancing!" << std::endl;
+            gridColumns = 0;
+        }
+        if (gridColumns <= 0 or gridRows <= 0)
+            gridColumns = gridRows = 0;
+    }
+    else if (param == "depthPrepass")
+        depthPrepass = (value == "1");
+    else if (param == "stats")
+        printStats = (value == "1");
+    else if (param == "accumulate") {
+        accumulate = (value == "1");
+        if (accumulate and !renderer->getCaps().floatTargets) {
+            std::cout << "Accumulation requires float render targets!" << std::endl;
+            accumulate = false;
+        }
+        if (accumulate and hdrFramebuffer == -1)
+            createHdrTarget();
+        if (accumulate and accumulationFramebuffers[0] == -1)
+            createAccumulationTarget();
+    }
+    else if (param == "denoise") {
+        denoise = (value == "1");
+        if (denoise and !renderer->getCaps().floatTargets) {
+            std::cout << "Denoising requires float render targets!" << std::endl;
+            denoise = false;
+        }
+        if (denoise and hdrFramebuffer == -1)
+            createHdrTarget();
+        if (denoise and guideFramebuffer == -1)
+            createDenoiseTargets();
+    }
+    else if (param == "denoiseIterations")
+        denoiseIterations = std::stoi(value);
+    else if (param == "denoiseColor")
+        denoiseColor = std::stof(value);
+    else if (param == "denoiseNormal")
+        denoiseNormal = std::stof(value);
+    else if (param == "denoiseDepth")
+        denoiseDepth = std::stof(value);
 
     assert(roughness >= 0.f and roughness <= 1.f);
     assert(gamma >= 1.f     and gamma <= 2.5f);
-    assert(numSamples > 0);
+    assert(numSamples > 0       and numSamples <= getMaxSamples());
     assert(lod >= 0.f       and lod <= 5.f);
+    assert(targetError >= 0.f and targetError <= 1.f);
+    assert(denoiseIterations >= 0 and denoiseIterations <= MaxDenoiseIterations);
+    assert(denoiseColor > 0.f and denoiseNormal > 0.f and denoiseDepth > 0.f);
+
+    if (shadingMode == ShadingMode::SplitSum and !prefilteredBaked and prefilteredLod != lod)
+        createPrefilteredMap();
 
-    // Compute sample half-vectors wh
+    selectShaders();
+    if (tableSamples > 0)
+        generateSamples(0);
+    accumulatedFrames = 0;
+
+    updateUniformBuffers();
+    if (gridColumns > 0)
+        updateGridInstances();
+}
+
+void App::generateSamples(int firstIndex)
+{
+    // Compute sample half-vectors wh, w holds the mip level filtering
+    // the environment over the sample's solid angle. The material grid
+    // retargets samples for roughness 1 to each instance in the shader.
+    // Accumulated frames continue the sequence where the previous one
+    // stopped and are filtered for all frames' samples together (see
+    // getFilterSamples), the average converges to that estimate.
+    const float texelSolidAngle = getPanoramaTexelSolidAngle();
+    const int filterSamples = getFilterSamples();
+    const float sampleRoughness = (gridColumns > 0)? 1.f : roughness;
     whs.clear();
     whs.reserve(numSamples);
+
+    // Canonical counts and roughnesses were computed by the compiler
+    const SampleTables::Sample* baked = accumulate ? nullptr : getBakedSamples(numSamples, sampleRoughness);
+    if (baked != nullptr) {
+        for (int i = 0; i < numSamples; i++)
+            whs.push_back(vec4(baked[i].x, baked[i].y, baked[i].z, baked[i].lod + lod));
+        return;
+    }
+
+    // Halton quasi-random sequence
+    std::vector<float> e1(numSamples), e2(numSamples);
+    std::vector<float> x(numSamples), y(numSamples), z(numSamples);
+    getHaltonBatch(firstIndex, numSamples, &e1[0], &e2[0]);
+    importanceSampleTrowbridgeReitzBatch(&e1[0], &e2[0], numSamples, sampleRoughness, &x[0], &y[0], &z[0]);
     for (int i = 0; i < numSamples; i++) {
-        // Halton quasi-random sequence
-        const vec2 halton = vec2(getRadicalInverse(i+1, 2),
-                                 getRadicalInverse(i+1, 3));
-        whs.push_back(importanceSampleTrowbridgeReitz(halton, roughness));
+        const float pdf = getTrowbridgeReitzPdf(z[i], sampleRoughness);
+        whs.push_back(vec4(x[i], y[i], z[i], getFilteredLod(pdf, filterSamples, texelSolidAngle) + lod));
     }
     assert(whs.size() == numSamples);
 }
 
+int App::getFilterSamples() const
+{
+    // One frame's worth of samples would blur every accumulated frame as
+    // much as a single one, and so would their average
+    return accumulate ? numSamples * maxAccumulatedFrames : numSamples;
+}
+
+int App::getMaxSamples() const
+{
+    if (sampleBank)
+        return SampleBankColumns;
+    return (materialBuffer != -1)? MaxUniformBufferSamples : MaxUniformSamples;
+}
+
+void App::selectShaders()
+{
+    // Loop bound is a compile-time constant, lower sample counts really run faster
+    std::vector<std::string> defines;
+    if (gridColumns > 0) {
+        defines.push_back("INSTANCED");
+        defines.push_back("NUM_SAMPLES " + std::to_string(numSamples));
+        shaderSamples = numSamples;
+    }
+    else if (F0 == vec3(0.f)) {
+        defines.push_back("DIFFUSE_ONLY");
+        shaderSamples = 0;
+    }
+    else if (roughness < MirrorRoughness) {
+        defines.push_back("MIRROR");
+        defines.push_back("NUM_SAMPLES 1");
+        shaderSamples = 1;
+    }
+    else {
+        defines.push_back("NUM_SAMPLES " + std::to_string(numSamples));
+        shaderSamples = numSamples;
+    }
+
+    // Fixed tables (compile-time, see sampletables.hpp) unless each
+    // accumulated frame needs a new set
+    const float sampleRoughness = (gridColumns > 0)? 1.f : roughness;
+    const int bakedLevel = accumulate ? -1 : getBakedLevel(numSamples, sampleRoughness);
+    bool baked = false;
+    tableSamples = shaderSamples;
+    maxAccumulatedFrames = MaxAccumulatedFrames;
+    const bool splitSum = shadingMode == ShadingMode::SplitSum and shaderSamples > 1;
+    if (splitSum) {
+        defines.push_back("SPLIT_SUM");
+        tableSamples = 0;
+    }
+    else if ((gpuSamples or vndf) and shaderSamples > 1) {
+        defines.push_back("GPU_SAMPLES");
+        if (vndf)
+            defines.push_back("VNDF");
+        tableSamples = 0;
+    }
+    else if (sampleBank and shaderSamples > 1) {
+        defines.push_back("SAMPLE_BANK");
+        tableSamples = 0;
+        // Each frame takes the bank's next numSamples columns, later ones
+        // would wrap around and only repeat earlier frames
+        maxAccumulatedFrames = std::max(SampleBankColumns / numSamples, 1);
+    }
+    else if (bakedLevel != -1 and shaderSamples > 1) {
+        defines.push_back("BAKED_SAMPLES");
+        defines.push_back("BAKED_LEVEL " + std::to_string(bakedLevel));
+        tableSamples = 0;
+        baked = true;
+    }
+
+    std::vector<std::string> meshFiles = {getEnvironmentPart(), "assets/material.part", "assets/sampling.part"};
+    if (baked)
+        meshFiles.push_back("assets/bakedsamples.part");
+    if (splitSum)
+        meshFiles.push_back("assets/prefiltered.part");
+    meshFiles.push_back("assets/mesh.fs");
+    // Both only make sense with a sampling loop
+    if (blueNoise and shaderSamples > 1 and !splitSum)
+        defines.push_back("BLUE_NOISE");
+    sampleCountShader = -1;
+    if (targetError > 0.f and shaderSamples > 1 and !splitSum) {
+        defines.push_back("ADAPTIVE");
+        std::vector<std::string> countDefines = defines;
+        countDefines.push_back("SAMPLE_COUNT_OUTPUT");
+        sampleCountShader = renderer->addShader({"assets/mesh.vs"}, meshFiles, countDefines);
+    }
+    if (accumulate or denoise)
+        defines.push_back("HDR_OUTPUT");
+    meshShader = renderer->addShader({"assets/mesh.vs"}, meshFiles, defines);
+
+    // Both methods with the same per-pixel Halton points
+    sampleRatioShaders[0] = sampleRatioShaders[1] = -1;
+    if (printStats and shaderSamples > 1 and renderer->getCaps().fragmentHighp) {
+        std::vector<std::string> ratioDefines = {"NUM_SAMPLES " + std::to_string(numSamples), "GPU_SAMPLES", "SAMPLE_RATIO_OUTPUT"};
+        if (gridColumns > 0)
+            ratioDefines.push_back("INSTANCED");
+        const std::vector<std::string> ratioFiles = {getEnvironmentPart(), "assets/material.part",
+                                                     "assets/sampling.part", "assets/mesh.fs"};
+        sampleRatioShaders[0] = renderer->addShader({"assets/mesh.vs"}, ratioFiles, ratioDefines);
+        ratioDefines.push_back("VNDF");
+        sampleRatioShaders[1] = renderer->addShader({"assets/mesh.vs"}, ratioFiles, ratioDefines);
+    }
+
+    // Same scene both ways, the reference generates its samples per pixel
+    splitSumErrorShaders[0] = splitSumErrorShaders[1] = -1;
+    if (printStats and splitSum and renderer->getCaps().fragmentHighp) {
+        std::vector<std::string> errorDefines = {"NUM_SAMPLES " + std::to_string(numSamples)};
+        if (gridColumns > 0)
+            errorDefines.push_back("INSTANCED");
+        std::vector<std::string> errorFiles = {getEnvironmentPart(), "assets/material.part", "assets/sampling.part"};
+        std::vector<std::string> referenceDefines = errorDefines;
+        referenceDefines.push_back("GPU_SAMPLES");
+        std::vector<std::string> referenceFiles = errorFiles;
+        referenceFiles.push_back("assets/mesh.fs");
+        splitSumErrorShaders[0] = renderer->addShader({"assets/mesh.vs"}, referenceFiles, referenceDefines);
+        errorDefines.push_back("SPLIT_SUM");
+        errorFiles.push_back("assets/prefiltered.part");
+        errorFiles.push_back("assets/mesh.fs");
+        splitSumErrorShaders[1] = renderer->addShader({"assets/mesh.vs"}, errorFiles, errorDefines);
+    }
+
+    std::vector<std::string> depthDefines;
+    if (gridColumns > 0)
+        depthDefines.push_back("INSTANCED");
+    depthShader = renderer->addShader({"assets/mesh.vs"}, {"assets/depth.fs"}, depthDefines);
+    guideShader = renderer->addShader({"assets/mesh.vs"}, {"assets/guide.fs"}, depthDefines);
+
+    std::vector<std::string> envDefines;
+    if (accumulate or denoise)
+        envDefines.push_back("HDR_OUTPUT");
+    envShader = renderer->addShader({"assets/env.vs"}, {getEnvironmentPart(), "assets/material.part", "assets/env.fs"}, envDefines);
+}
+
+void App::createDiagnosticsTarget()
+{
+    const TextureID color = renderer->addEmptyTexture(canvasWidth, canvasHeight, PixelFormat::Rgba, PixelType::Ubyte);
+    const RenderbufferID depth = renderer->addRenderbuffer(canvasWidth, canvasHeight, PixelFormat::Depth16);
+    diagnosticsFramebuffer = renderer->addFramebuffer();
+    renderer->attachTextureToFramebuffer(diagnosticsFramebuffer, color);
+    renderer->attachRenderbufferToFramebuffer(diagnosticsFramebuffer, depth);
+    renderer->setDefaultFramebuffer();
+}
+
+std::vector<u8> App::readDiagnostics()
+{
+    // Alpha marks covered pixels, the background is cleared to 0
+    std::vector<u8> pixels(canvasWidth * canvasHeight * 4);
+    renderer->readPixels(0, 0, canvasWidth, canvasHeight, &pixels[0]);
+    return pixels;
+}
+
+void App::createPrefilteredMap()
+{
+    if (prefilteredFramebuffer == -1) {
+        prefilteredMap = renderer->addEmptyTexture(PrefilteredWidth, PrefilteredLevels * PrefilteredLevelHeight,
+                                                   PixelFormat::Rgba, PixelType::Ubyte);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); // Longitude wraps around
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        prefilteredFramebuffer = renderer->addFramebuffer();
+        renderer->attachTextureToFramebuffer(prefilteredFramebuffer, prefilteredMap);
+    }
+    prefilterShader = renderer->addShader({}, {getEnvironmentPart(), "assets/prefiltered.part", "assets/prefilter.fs"},
+                                          {"NUM_SAMPLES " + std::to_string(PrefilterSamples)});
+
+    // Each level is one screen quad into its part of the atlas, on the GPU
+    // it takes milliseconds
+    renderer->setFramebuffer(prefilteredFramebuffer);
+    renderer->setShader(prefilterShader);
+    renderer->setDepthTest(false);
+    renderer->setCulling(false);
+    renderer->setColorWrite(true);
+    renderer->setTexture(0, getEnvironmentMap());
+    renderer->setUniform(uniforms.env, 0);
+
+    const float texelSolidAngle = getPanoramaTexelSolidAngle();
+    std::vector<float> e1(PrefilterSamples), e2(PrefilterSamples);
+    std::vector<float> x(PrefilterSamples), y(PrefilterSamples), z(PrefilterSamples);
+    std::vector<vec4> samples(PrefilterSamples);
+    getHaltonBatch(0, PrefilterSamples, &e1[0], &e2[0]);
+    for (int level = 0; level < PrefilteredLevels; level++) {
+        const float levelRoughness = static_cast<float>(level) / (PrefilteredLevels-1);
+        importanceSampleTrowbridgeReitzBatch(&e1[0], &e2[0], PrefilterSamples, levelRoughness, &x[0], &y[0], &z[0]);
+        for (int i = 0; i < PrefilterSamples; i++) {
+            const float pdf = getTrowbridgeReitzPdf(z[i], levelRoughness);
+            samples[i] = vec4(x[i], y[i], z[i], getFilteredLod(pdf, PrefilterSamples, texelSolidAngle) + lod);
+        }
+        renderer->setViewport(0, level * PrefilteredLevelHeight, PrefilteredWidth, PrefilteredLevelHeight);
+        renderer->setUniform(uniforms.prefilterSamples, &samples[0], PrefilterSamples);
+        renderer->drawScreenQuad();
+    }
+    renderer->setViewport(0, 0, canvasWidth, canvasHeight);
+    renderer->setDefaultFramebuffer();
+    prefilteredLod = lod;
+}
+
+void App::loadOctahedralMap()
+{
+    // Converted by tools/octahedral.cpp, level 0 on the left and the others
+    // stacked to its right, each with 1px of padding
+    const int size = 512;
+    if (renderer->getCaps().textureLod) {
+        std::vector<TextureRect> levels;
+        for (int i = 0; i < 6; i++) {
+            const int levelSize = size >> i;
+            if (i == 0)
+                levels.push_back(TextureRect{1, 1, size, size});
+            else
+                levels.push_back(TextureRect{size + 3, size - 1 + 2*i - 2*levelSize, levelSize, levelSize});
+        }
+        envOctahedral = renderer->addMipmappedTexture("assets/octahedral.tga", levels);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    }
+    else {
+        envOctahedral = renderer->addTexture("assets/octahedral.tga", PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    }
+}
+
+TextureID App::getEnvironmentMap() const
+{
+    if (environmentFormat == EnvironmentFormat::Octahedral)
+        return envOctahedral;
+    if (environmentFormat == EnvironmentFormat::Cubemap)
+        return envCubemap;
+    return envPanorama;
+}
+
+std::string App::getEnvironmentPart() const
+{
+    if (environmentFormat == EnvironmentFormat::Octahedral)
+        return "assets/octahedral.part";
+    if (environmentFormat == EnvironmentFormat::Cubemap)
+        return "assets/cubemap.part";
+    return "assets/panorama.part";
+}
+
+void App::createDfgLut()
+{
+    // Scale and bias in [0, 1], 16 bits each as high and low bytes. Both
+    // bytes interpolate linearly, so bilinear filtering still works.
+    const std::vector<vec2> lut = buildDfgLut(DfgLutSize, DfgLutSamples);
+    std::vector<u8> texels;
+    texels.reserve(lut.size() * 4);
+    auto pushSplit = [&texels](float value) {
+        const float scaled = glm::clamp(value, 0.f, 1.f) * 255.f;
+        const float high = std::floor(scaled);
+        texels.push_back(static_cast<u8>(high));
+        texels.push_back(static_cast<u8>(std::min(std::round((scaled - high) * 255.f), 255.f)));
+    };
+    for (const vec2& scaleBias : lut) {
+        pushSplit(scaleBias.x);
+        pushSplit(scaleBias.y);
+    }
+    dfgLut = renderer->addTextureFromData(DfgLutSize, DfgLutSize, PixelFormat::Rgba, PixelType::Ubyte, &texels[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+void App::createHdrTarget()
+{
+    hdrTexture = renderer->addEmptyTexture(canvasWidth, canvasHeight, PixelFormat::Rgba, PixelType::Float);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    // The denoiser's taps land outside the screen too
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    hdrDepth = renderer->addRenderbuffer(canvasWidth, canvasHeight, PixelFormat::Depth16);
+    hdrFramebuffer = renderer->addFramebuffer();
+    renderer->attachTextureToFramebuffer(hdrFramebuffer, hdrTexture);
+    renderer->attachRenderbufferToFramebuffer(hdrFramebuffer, hdrDepth);
+    renderer->setDefaultFramebuffer();
+}
+
+void App::createDenoiseTargets()
+{
+    // See createHdrTarget
+    auto setSampling = []() {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    };
+    // Same depth buffer as the HDR target, the guide pass lays it down
+    guideTexture = renderer->addEmptyTexture(canvasWidth, canvasHeight, PixelFormat::Rgba, PixelType::Float);
+    setSampling();
+    guideFramebuffer = renderer->addFramebuffer();
+    renderer->attachTextureToFramebuffer(guideFramebuffer, guideTexture);
+    renderer->attachRenderbufferToFramebuffer(guideFramebuffer, hdrDepth);
+
+    // Ping-pong between the iterations
+    for (int i = 0; i < 2; i++) {
+        denoiseTextures[i] = renderer->addEmptyTexture(canvasWidth, canvasHeight, PixelFormat::Rgba, PixelType::Float);
+        setSampling();
+        denoiseFramebuffers[i] = renderer->addFramebuffer();
+        renderer->attachTextureToFramebuffer(denoiseFramebuffers[i], denoiseTextures[i]);
+    }
+    renderer->setDefaultFramebuffer();
+}
+
+void App::updateUniformBuffers()
+{
+    if (materialBuffer == -1)
+        return;
+
+    // Unchanged contents are skipped by the renderer
+    MaterialBlock material;
+    material.F0 = F0;
+    material.roughness = roughness;
+    material.kd = kd;
+    material.gamma = gamma;
+    renderer->updateUniformBuffer(materialBuffer, &material, sizeof(material));
+    if (tableSamples > 0)
+        renderer->updateUniformBuffer(samplesBuffer, &whs[0], tableSamples*sizeof(vec4));
+}
+
+void App::updateGridInstances()
+{
+    // Fit the grid into the view, roughly one unit sized mesh per cell
+    const float spacing = 3.f / std::max(gridColumns, gridRows);
+    const float scale = 0.4f * spacing;
+    std::vector<Instance> instances;
+    instances.reserve(gridColumns * gridRows);
+    for (int j = 0; j < gridRows; j++) {
+        for (int i = 0; i < gridColumns; i++) {
+            const float s = (gridColumns > 1)? static_cast<float>(i) / (gridColumns-1) : 0.f;
+            const float t = (gridRows > 1)?    static_cast<float>(j) / (gridRows-1)    : 0.f;
+            const vec3 offset = spacing * vec3(i - 0.5f*(gridColumns-1), 0.5f*(gridRows-1) - j, 0.f);
+
+            Instance instance;
+            instance.model = glm::scale(glm::translate(mat4(1.f), offset), vec3(scale));
+            instance.F0Roughness = vec4(mix(F0, vec3(1.f), t), mix(MirrorRoughness, 1.f, s));
+            instance.kd = vec4(kd, 0.f);
+            instances.push_back(instance);
+        }
+    }
+
+    if (gridInstances == -1)
+        gridInstances = renderer->addInstanceBuffer();
+    renderer->updateInstanceBuffer(gridInstances, &instances[0], instances.size());
+}
+
 App::~App()
 {
+    delete renderQueue;
     delete renderer;
 }
 
@@ -96,14 +608,99 @@ bool App::setup()
         return false;
 
     renderer   = new Renderer(canvasWidth, canvasHeight);
+    renderQueue = new RenderQueue(renderer);
     meshes[0]  = renderer->addMesh("assets/walt.rawmesh");
     meshes[1]  = renderer->addMesh("assets/icosphere.rawmesh");
-    meshShader = renderer->addShader({"assets/mesh.vs"}, {"assets/panorama.part", "assets/mesh.fs"});
-    envShader  = renderer->addShader({"assets/env.vs"}, {"assets/panorama.part", "assets/env.fs"});
+    tonemapShader = renderer->addShader({}, {"assets/material.part", "assets/tonemap.fs"});
+    atrousShader  = renderer->addShader({}, {"assets/atrous.fs"});
+    accumulateShader = renderer->addShader({}, {"assets/accumulate.fs"});
+    if (renderer->getCaps().uniformBuffers) {
+        materialBuffer = renderer->addUniformBuffer("Material", sizeof(MaterialBlock));
+        samplesBuffer  = renderer->addUniformBuffer("Samples", MaxUniformBufferSamples*sizeof(vec4));
+    }
 
-    envPanorama = renderer->addTexture("assets/grace.tga", PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    uniforms.mvp            = renderer->getUniform<mat4>("mvp");
+    uniforms.viewProjection = renderer->getUniform<mat4>("viewProjection");
+    uniforms.model          = renderer->getUniform<mat4>("model");
+    uniforms.viewOrigin     = renderer->getUniform<vec3>("viewOrigin");
+    uniforms.env            = renderer->getUniform<int>("env");
+    uniforms.F0             = renderer->getUniform<vec3>("F0");
+    uniforms.kd             = renderer->getUniform<vec3>("kd");
+    uniforms.roughness      = renderer->getUniform<float>("roughness");
+    uniforms.gamma          = renderer->getUniform<float>("gamma");
+    uniforms.whs            = renderer->getUniform<vec4>("whs");
+    uniforms.targetError    = renderer->getUniform<float>("targetError");
+    uniforms.sampleOffset   = renderer->getUniform<int>("sampleOffset");
+    uniforms.lodBias        = renderer->getUniform<float>("lodBias");
+    uniforms.filterSamples  = renderer->getUniform<float>("filterSamples");
+    uniforms.texelSolidAngle = renderer->getUniform<float>("texelSolidAngle");
+    uniforms.sampleBank     = renderer->getUniform<int>("sampleBank");
+    uniforms.sampleBankSize = renderer->getUniform<vec2>("sampleBankSize");
+    uniforms.blueNoise      = renderer->getUniform<int>("blueNoise");
+    uniforms.blueNoiseScale = renderer->getUniform<vec2>("blueNoiseScale");
+    uniforms.blueNoiseOffset = renderer->getUniform<float>("blueNoiseOffset");
+    uniforms.fb             = renderer->getUniform<int>("fb");
+    uniforms.average        = renderer->getUniform<int>("average");
+    uniforms.accumulationWeight = renderer->getUniform<float>("accumulationWeight");
+    uniforms.uvScale        = renderer->getUniform<vec2>("uvScale");
+    uniforms.uvOff          = renderer->getUniform<vec2>("uvOff");
+    uniforms.guide          = renderer->getUniform<int>("guide");
+    uniforms.texelSize      = renderer->getUniform<vec2>("texelSize");
+    uniforms.stepWidth      = renderer->getUniform<float>("stepWidth");
+    uniforms.sigmaColor     = renderer->getUniform<float>("sigmaColor");
+    uniforms.sigmaNormal    = renderer->getUniform<float>("sigmaNormal");
+    uniforms.sigmaDepth     = renderer->getUniform<float>("sigmaDepth");
+    uniforms.prefiltered    = renderer->getUniform<int>("prefiltered");
+    uniforms.dfgLut         = renderer->getUniform<int>("dfgLut");
+    uniforms.prefilterSamples = renderer->getUniform<vec4>("prefilterSamples");
+
+    // Measure the depth pre-pass and the shading pass, e.g. to compare with
+    // and without the pre-pass. The guide pass is submitted as the pre-pass.
+    if (renderer->getCaps().occlusionQueries) {
+        prepassSamplesQuery = renderer->addQuery(QueryType::SamplesPassed);
+        renderQueue->setPassQuery(RenderPass::DepthPrepass, QueryType::SamplesPassed, prepassSamplesQuery);
+        opaqueSamplesQuery = renderer->addQuery(QueryType::SamplesPassed);
+        renderQueue->setPassQuery(RenderPass::Opaque, QueryType::SamplesPassed, opaqueSamplesQuery);
+    }
+    if (renderer->getCaps().timerQueries) {
+        prepassTimeQuery = renderer->addQuery(QueryType::TimeElapsed);
+        renderQueue->setPassQuery(RenderPass::DepthPrepass, QueryType::TimeElapsed, prepassTimeQuery);
+        opaqueTimeQuery = renderer->addQuery(QueryType::TimeElapsed);
+        renderQueue->setPassQuery(RenderPass::Opaque, QueryType::TimeElapsed, opaqueTimeQuery);
+    }
+
+    if (renderer->getCaps().textureLod) {
+        // Atlas levels as a real mip chain, see tools/mipatlas.cpp for the layout
+        std::vector<TextureRect> levels;
+        for (int i = 0; i < 6; i++)
+            levels.push_back(TextureRect{0, (512 >> i) - 2*i, 1024 >> i, 512 >> i});
+        envPanorama = renderer->addMipmappedTexture("assets/grace.tga", levels);
+    }
+    else {
+        envPanorama = renderer->addTexture("assets/grace.tga", PixelFormat::Rgba, PixelFormat::Rgba, PixelType::Ubyte);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        // The padding columns and level 0's bottom row (tools/mipatlas.cpp)
+        // are fetched across the atlas' edges
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+
+    // Generated by tools/bluenoise.cpp, tiled over the screen one texel per pixel
+    blueNoiseMask = renderer->addTexture("assets/bluenoise.tga", PixelFormat::R, PixelFormat::R, PixelType::Ubyte);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Built once, any roughness and sample count up to SampleBankColumns
+    if (renderer->getCaps().floatTextures) {
+        const std::vector<vec4> bank = buildSampleBank(SampleBankColumns, SampleBankRows, getPanoramaTexelSolidAngle());
+        sampleBankTexture = renderer->addTextureFromData(SampleBankColumns, SampleBankRows,
+                                                         PixelFormat::Rgba, PixelType::Float, &bank[0]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    }
 
     setValue("dummy", "dummy");
     return true;
@@ -111,6 +708,7 @@ bool App::setup()
 
 void App::drawFrame()
 {
+    renderer->beginFrame();
     renderer->liveReloadUpdate();
 
     const vec3 worldUp = vec3(0.f, 1.f, 0.f);
@@ -123,40 +721,317 @@ void App::drawFrame()
                              vec3(0.f, 0.f, 0.f),
                              worldUp);
     const float ratio = static_cast<float>(canvasWidth) / canvasHeight;
-    const mat4 projection = glm::perspective(60.f, ratio, 0.5f, 100.f);
-    const mat4 mvp = projection * view;
+    const mat4 projection = glm::perspective(60.f, ratio, NearPlane, FarPlane);
+    const mat4 viewProjection = projection * view;
+    const mat4 model = mat4(1.f);
 
     renderer->setViewport(0, 0, canvasWidth, canvasHeight);
+    if (accumulate) {
+        if (accumulatedFrames >= maxAccumulatedFrames) {
+            // Converged, only present the average. Stats keep coming (with
+            // the last frame's measurements), so they don't look stuck.
+            presentHdr();
+            if (printStats)
+                printFrameStats();
+            return;
+        }
+        if (tableSamples > 0) {
+            generateSamples(accumulatedFrames * numSamples);
+            updateUniformBuffers();
+        }
+    }
+    renderer->setDepthWrite(true); // Otherwise the clear is masked too
     glClearColor(0.f, 0.f, 0.f, 0.f);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
+
+    // Background and mesh cover every pixel, no color clear needed
+    // Mesh (or the grid) is centered at the origin
+    const float meshDepth = glm::length(cameraPosition) / FarPlane;
+    auto addMeshDraw = [&](RenderPass pass, ShaderID shader, const RasterState& raster) {
+        if (gridColumns > 0) {
+            renderQueue->addInstancedDraw(pass, shader, meshes[currentMeshInd],
+                                          gridInstances, gridColumns*gridRows, meshDepth, raster);
+        }
+        else {
+            renderQueue->addDraw(pass, shader, meshes[currentMeshInd], meshDepth, raster);
+            renderQueue->setUniform(uniforms.model, &model);
+        }
+        renderQueue->setUniform(uniforms.viewProjection, &viewProjection);
+    };
+
+    if (denoise) {
+        // Normals and distances for the filter. The depth buffer is shared
+        // with the HDR target, so this doubles as the depth pre-pass.
+        renderer->setFramebuffer(guideFramebuffer);
+        renderer->setColorWrite(true);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        renderQueue->clear();
+        addMeshDraw(RenderPass::DepthPrepass, guideShader, RasterState());
+        renderQueue->setUniform(uniforms.viewOrigin, &cameraPosition);
+        renderQueue->submit();
+        renderer->setFramebuffer(hdrFramebuffer);
+    }
+    else {
+        if (accumulate)
+            renderer->setFramebuffer(hdrFramebuffer);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
 
     const mat4 modelEnv = glm::scale(mat4(1.f), vec3(10.f));
     const mat4 viewEnv = glm::lookAt(vec3(0.f), -cameraPosition, worldUp);
     const mat4 mvpEnv = projection * viewEnv * modelEnv;
 
-    renderer->setShader(envShader);
-    renderer->setUniform4x4fv("mvp", 1, &mvpEnv[0][0]);
-    renderer->setTexture(0, envPanorama);
-    renderer->setUniform1i("env", 0);
-    renderer->setUniform1f("gamma", gamma);
-    renderer->drawMesh(meshes[1]); // Icosphere
-
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    renderer->setShader(meshShader);
-    renderer->setUniform4x4fv("mvp", 1, &mvp[0][0]);
-    renderer->setUniform3fv("viewOrigin", 1, &cameraPosition[0]);
-    renderer->setTexture(0, envPanorama);
-    renderer->setUniform1i("env", 0);
-    renderer->setUniform3fv("F0", 1, &F0[0]);
-    renderer->setUniform3fv("kd", 1, &kd[0]);
-    renderer->setUniform1f("roughness", roughness);
-    renderer->setUniform1f("lod", lod);
-    renderer->setUniform1f("gamma",     gamma);
-    renderer->setUniform3fv("whs", numSamples, &whs[0][0]);
-    renderer->drawMesh(meshes[currentMeshInd]);
+    renderQueue->clear();
+
+    RasterState envRaster;
+    envRaster.depthTest = false;
+    envRaster.culling = false;
+    renderQueue->addDraw(RenderPass::Background, envShader, meshes[1], 0.f, envRaster); // Icosphere
+    renderQueue->setTexture(0, getEnvironmentMap());
+    renderQueue->setUniform(uniforms.mvp, &mvpEnv);
+    renderQueue->setUniform(uniforms.env, 0);
+    if (materialBuffer == -1)
+        renderQueue->setUniform(uniforms.gamma, gamma);
+
+    RasterState meshRaster;
+    if (denoise) {
+        // Depth is already there, see the guide pass
+        meshRaster.depthFunc = DepthFunc::Equal;
+        meshRaster.depthWrite = false;
+    }
+    else if (depthPrepass) {
+        // Lay down depth first, so the expensive shader runs once per pixel
+        RasterState depthRaster;
+        depthRaster.colorWrite = false;
+        addMeshDraw(RenderPass::DepthPrepass, depthShader, depthRaster);
+        meshRaster.depthFunc = DepthFunc::Equal;
+        meshRaster.depthWrite = false;
+    }
+
+    // Accumulated frames shift the mask by the golden ratio, each pixel's
+    // rotations stay well spread over time
+    const vec2 blueNoiseScale = vec2(1.f / BlueNoiseSize);
+    const float blueNoiseOffset = fract(accumulatedFrames * 0.618034f);
+    const vec2 sampleBankSize = vec2(SampleBankColumns, SampleBankRows);
+    auto addShadingDraw = [&](RenderPass pass, ShaderID shader, const RasterState& raster) {
+        addMeshDraw(pass, shader, raster);
+        renderQueue->setTexture(0, getEnvironmentMap());
+        renderQueue->setUniform(uniforms.viewOrigin, &cameraPosition);
+        renderQueue->setUniform(uniforms.env, 0);
+        renderQueue->setUniform(uniforms.targetError, targetError);
+        if (tableSamples == 0) {
+            renderQueue->setUniform(uniforms.sampleOffset, accumulatedFrames * numSamples);
+            renderQueue->setUniform(uniforms.lodBias, lod);
+            renderQueue->setUniform(uniforms.filterSamples, static_cast<float>(getFilterSamples()));
+            renderQueue->setUniform(uniforms.texelSolidAngle, getPanoramaTexelSolidAngle());
+        }
+        if (shadingMode == ShadingMode::SplitSum) {
+            renderQueue->setTexture(1, prefilteredMap);
+            renderQueue->setUniform(uniforms.prefiltered, 1);
+            renderQueue->setTexture(2, dfgLut);
+            renderQueue->setUniform(uniforms.dfgLut, 2);
+        }
+        else if (sampleBank) {
+            renderQueue->setTexture(2, sampleBankTexture);
+            renderQueue->setUniform(uniforms.sampleBank, 2);
+            renderQueue->setUniform(uniforms.sampleBankSize, &sampleBankSize);
+        }
+        if (blueNoise and shadingMode == ShadingMode::FilteredIS) {
+            renderQueue->setTexture(1, blueNoiseMask);
+            renderQueue->setUniform(uniforms.blueNoise, 1);
+            renderQueue->setUniform(uniforms.blueNoiseScale, &blueNoiseScale);
+            renderQueue->setUniform(uniforms.blueNoiseOffset, blueNoiseOffset);
+        }
+        if (materialBuffer == -1) {
+            // No uniform buffers (WebGL 1.0)
+            renderQueue->setUniform(uniforms.F0, &F0);
+            renderQueue->setUniform(uniforms.kd, &kd);
+            renderQueue->setUniform(uniforms.roughness, roughness);
+            renderQueue->setUniform(uniforms.gamma, gamma);
+            if (tableSamples > 0)
+                renderQueue->setUniform(uniforms.whs, &whs[0], tableSamples);
+        }
+    };
+    addShadingDraw(RenderPass::Opaque, meshShader, meshRaster);
+
+    renderQueue->submit();
+
+    // Stats are due this frame, measure with extra draws into an offscreen
+    // target (each readback stalls)
+    auto drawDiagnostics = [&](ShaderID shader) {
+        if (diagnosticsFramebuffer == -1)
+            createDiagnosticsTarget();
+        renderer->setFramebuffer(diagnosticsFramebuffer);
+        renderer->setDepthWrite(true);
+        renderer->setColorWrite(true);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        renderQueue->clear();
+        addShadingDraw(RenderPass::Diagnostics, shader, RasterState());
+        renderQueue->submit();
+        const std::vector<u8> pixels = readDiagnostics();
+        renderer->setDefaultFramebuffer();
+        return pixels;
+    };
+    if (printStats and glfwGetTime() - statsTime >= 1.0) {
+        // Red is a ratio, e.g. samples taken / NUM_SAMPLES
+        if (sampleCountShader != -1)
+            samplesPerPixel = getCoveredAverage(drawDiagnostics(sampleCountShader)) * shaderSamples;
+        for (int i = 0; i < 2; i++) {
+            if (sampleRatioShaders[i] != -1)
+                sampleRatios[i] = getCoveredAverage(drawDiagnostics(sampleRatioShaders[i]));
+        }
+        if (splitSumErrorShaders[0] != -1) {
+            splitSumError = getCoveredError(drawDiagnostics(splitSumErrorShaders[1]),
+                                            drawDiagnostics(splitSumErrorShaders[0]));
+        }
+    }
+
+    if (accumulate) {
+        accumulateHdr();
+        accumulatedFrames++;
+        if (printStats and accumulatedFrames == maxAccumulatedFrames)
+            std::cout << "accumulation converged after " << accumulatedFrames << " frames" << std::endl;
+    }
+    if (accumulate or denoise) {
+        renderer->setDefaultFramebuffer();
+        presentHdr();
+    }
+
+    if (printStats)
+        printFrameStats();
+}
+
+void App::createAccumulationTarget()
+{
+    // See createHdrTarget, only ever drawn with screen quads
+    for (int i = 0; i < 2; i++) {
+        accumulationTextures[i] = renderer->addEmptyTexture(canvasWidth, canvasHeight, PixelFormat::Rgba, PixelType::Float);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        accumulationFramebuffers[i] = renderer->addFramebuffer();
+        renderer->attachTextureToFramebuffer(accumulationFramebuffers[i], accumulationTextures[i]);
+    }
+    renderer->setDefaultFramebuffer();
+}
+
+void App::accumulateHdr()
+{
+    // Frame n mixes into target n % 2, reading the average from the other
+    // one. The first frame has no average yet and is mixed with itself.
+    const int target = accumulatedFrames % 2;
+    const TextureID average = (accumulatedFrames == 0)? hdrTexture : accumulationTextures[1 - target];
+    renderer->setFramebuffer(accumulationFramebuffers[target]);
+    renderer->setShader(accumulateShader);
+    renderer->setDepthTest(false);
+    renderer->setCulling(false);
+    renderer->setColorWrite(true);
+    renderer->setTexture(0, hdrTexture);
+    renderer->setUniform(uniforms.fb, 0);
+    renderer->setTexture(1, average);
+    renderer->setUniform(uniforms.average, 1);
+    renderer->setUniform(uniforms.accumulationWeight, 1.f / (accumulatedFrames + 1));
+    renderer->drawScreenQuad();
+    renderer->setDefaultFramebuffer();
+}
+
+TextureID App::filterHdr(TextureID source)
+{
+    // Edge-avoiding a-trous wavelet (Dammertz et al. 2010), taps spread
+    // 1, 2, 4... texels apart and the color sigma halves each iteration
+    const vec2 texelSize = vec2(1.f / canvasWidth, 1.f / canvasHeight);
+    renderer->setShader(atrousShader);
+    renderer->setDepthTest(false);
+    renderer->setCulling(false);
+    renderer->setColorWrite(true);
+    renderer->setTexture(1, guideTexture);
+    renderer->setUniform(uniforms.guide, 1);
+    renderer->setUniform(uniforms.texelSize, &texelSize);
+    renderer->setUniform(uniforms.sigmaNormal, denoiseNormal);
+    renderer->setUniform(uniforms.sigmaDepth, denoiseDepth);
+
+    for (int i = 0; i < denoiseIterations; i++) {
+        renderer->setFramebuffer(denoiseFramebuffers[i % 2]);
+        renderer->setTexture(0, source);
+        renderer->setUniform(uniforms.fb, 0);
+        renderer->setUniform(uniforms.stepWidth, static_cast<float>(1 << i));
+        renderer->setUniform(uniforms.sigmaColor, denoiseColor / (1 << i));
+        renderer->drawScreenQuad();
+        source = denoiseTextures[i % 2];
+    }
+    renderer->setDefaultFramebuffer();
+    return source;
+}
+
+void App::presentHdr()
+{
+    // Accumulated (the running average) and/or denoised
+    // The last accumulateHdr wrote (accumulatedFrames - 1) % 2
+    const TextureID average = accumulate ? accumulationTextures[(accumulatedFrames + 1) % 2] : hdrTexture;
+    const TextureID source = denoise ? filterHdr(average) : average;
+    const vec2 uvScale = vec2(1.f);
+    const vec2 uvOff = vec2(0.f);
+    renderer->setShader(tonemapShader);
+    renderer->setDepthTest(false);
+    renderer->setCulling(false);
+    renderer->setColorWrite(true);
+    renderer->setTexture(0, source);
+    renderer->setUniform(uniforms.fb, 0);
+    renderer->setUniform(uniforms.uvScale, &uvScale);
+    renderer->setUniform(uniforms.uvOff, &uvOff);
+    if (materialBuffer == -1)
+        renderer->setUniform(uniforms.gamma, gamma);
+    renderer->drawScreenQuad();
+}
+
+void App::printFrameStats()
+{
+    // Once per second is plenty for eyeballing
+    statsFrames++;
+    const double time = glfwGetTime();
+    if (time - statsTime < 1.0)
+        return;
+
+    const RendererStats& stats = renderer->getStats();
+    std::cout << "fps: " << statsFrames / (time - statsTime)
+              << ", uniform uploads: " << stats.uniformUploads
+              << " (elided " << stats.uniformUploadsElided << ")"
+              << ", buffer uploads: " << stats.bufferUploads
+              << " (elided " << stats.bufferUploadsElided << ")"
+              << ", state changes: " << stats.stateChanges
+              << " (skipped " << stats.stateChangesSkipped << ")" << std::endl;
+    if (opaqueSamplesQuery != -1 or opaqueTimeQuery != -1) {
+        auto printPass = [&](QueryID samplesQuery, QueryID timeQuery) {
+            if (samplesQuery != -1)
+                std::cout << " " << renderer->getQueryResult(samplesQuery) << " fragments";
+            if (timeQuery != -1)
+                std::cout << " " << renderer->getQueryResult(timeQuery) * 1e-6 << " ms";
+            std::cout << std::endl;
+        };
+        // Without a pre-pass its queries only hold stale results
+        const bool prepass = depthPrepass or denoise;
+        if (prepass) {
+            std::cout << (denoise ? "guide pass:" : "depth pre-pass:");
+            printPass(prepassSamplesQuery, prepassTimeQuery);
+        }
+        std::cout << "shading pass" << (shadingMode == ShadingMode::SplitSum ? " (split sum)" : "") << ":";
+        printPass(opaqueSamplesQuery, opaqueTimeQuery);
+        // What to compare against the shading pass alone without the pre-pass
+        if (prepass and opaqueTimeQuery != -1) {
+            const u64 total = renderer->getQueryResult(prepassTimeQuery) + renderer->getQueryResult(opaqueTimeQuery);
+            std::cout << "pre-pass and shading: " << total * 1e-6 << " ms" << std::endl;
+        }
+    }
+    if (sampleCountShader != -1)
+        std::cout << "adaptive: " << samplesPerPixel << " of " << shaderSamples << " samples per pixel" << std::endl;
+    if (sampleRatioShaders[0] != -1) {
+        std::cout << "samples above the horizon: " << 100.f * sampleRatios[0] << "% (importance sampling), "
+                  << 100.f * sampleRatios[1] << "% (VNDF)" << std::endl;
+    }
+    if (splitSumErrorShaders[0] != -1)
+        std::cout << "split sum vs filtered IS: RMSE " << splitSumError << " (8-bit)" << std::endl;
+    statsTime = time;
+    statsFrames = 0;
 }
 
 void App::onKey(int key, int action)
@@ -177,6 +1052,8 @@ void App::onMousePos(int x, int y)
         cameraPhi   -= (dx / canvasWidth)  * TwoPI;
         cameraTheta -= (dy / canvasHeight) * PI;
         cameraTheta = glm::clamp(cameraTheta, 0.001f, PI-0.001f);
+        if (dx != 0.f or dy != 0.f)
+            accumulatedFrames = 0;
     }
 }
 
@@ -2,6 +2,7 @@
 #define __APP_HPP__
 
 #include "renderer.hpp"
+#include "renderqueue.hpp"
 
 #include <GL/glew.h>
 #include <GL/glfw.h>
@@ -13,6 +14,20 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+// Specular integral: filtered importance sampling per pixel, or the
+// split-sum approximation (prefiltered radiance times a DFG table)
+enum class ShadingMode {
+    FilteredIS,
+    SplitSum
+};
+
+// Environment map parametrization, all RGBM with 6 levels
+enum class EnvironmentFormat {
+    Panorama,   // Lat-long, assets/panorama.part
+    Octahedral, // assets/octahedral.part, converted by tools/octahedral.cpp
+    Cubemap     // assets/cubemap.part, requires caps.textureLod
+};
+
 class App {
 public:
     App(int canvasWidth, int canvasHeight): canvasWidth(canvasWidth), canvasHeight(canvasHeight) {}
@@ -31,6 +46,53 @@ public:
     void setValue(const std::string& param, const std::string& value);
 
 private:
+    // Sample table in a uniform array is capped by the uniform register budget,
+    // a uniform buffer is guaranteed 16KB
+    static const int MaxUniformSamples = 50;
+    static const int MaxUniformBufferSamples = 1024;
+    // Sample bank texture, samples (max count) by roughness levels
+    static const int SampleBankColumns = 1024;
+    static const int SampleBankRows = 64;
+    // Below this roughness the lobe is treated as a perfect mirror
+    static constexpr float MirrorRoughness = 0.01f;
+    static constexpr float NearPlane = 0.5f;
+    static constexpr float FarPlane = 100.f;
+    // Accumulation stops here, the running average has converged by then
+    static const int MaxAccumulatedFrames = 256;
+    // Side of assets/bluenoise.tga
+    static const int BlueNoiseSize = 64;
+    // A-trous iterations, the last one spreads its taps 2^(n-1) texels
+    static const int MaxDenoiseIterations = 5;
+    // Split-sum radiance map, see assets/prefiltered.part for the layout
+    static const int PrefilteredLevels = 8;
+    static const int PrefilteredWidth = 512;
+    static const int PrefilteredLevelHeight = 256;
+    static const int PrefilterSamples = 32;
+    static const int DfgLutSize = 64;
+    static const int DfgLutSamples = 1024;
+
+    int getMaxSamples() const;
+    // Sample count the filtered lods are computed for
+    int getFilterSamples() const;
+    void selectShaders();
+    void generateSamples(int firstIndex);
+    void createHdrTarget();
+    void createDenoiseTargets();
+    void createAccumulationTarget();
+    void accumulateHdr();
+    TextureID filterHdr(TextureID source);
+    void presentHdr();
+    void createDiagnosticsTarget();
+    std::vector<u8> readDiagnostics();
+    void createPrefilteredMap();
+    void createDfgLut();
+    void loadOctahedralMap();
+    TextureID getEnvironmentMap() const;
+    std::string getEnvironmentPart() const;
+    void updateUniformBuffers();
+    void updateGridInstances();
+    void printFrameStats();
+
     int canvasWidth, canvasHeight;
     int mouseStartX, mouseStartY;
     bool dragging = false;
@@ -39,18 +101,152 @@ private:
     float cameraR     = 3.f;
 
     Renderer* renderer = nullptr;
+    RenderQueue* renderQueue = nullptr;
     MeshID meshes[3];
     int currentMeshInd = 0;
-    ShaderID meshShader;
+    ShaderID meshShader; // Selected permutation, see selectShaders
+    int shaderSamples = 0;
+    int tableSamples = 0; // Entries of whs the shader reads, 0 with GPU sampling
     ShaderID envShader;
+    ShaderID tonemapShader;
+    ShaderID depthShader;
+    ShaderID guideShader;
+    ShaderID atrousShader;
+    ShaderID accumulateShader;
+    ShaderID prefilterShader = -1;
+    ShaderID sampleCountShader = -1; // Adaptive permutation outputting samples taken
+    // Share of samples above the horizon, importance sampling and VNDF
+    ShaderID sampleRatioShaders[2] = {-1, -1};
+    // Filtered IS reference and split sum, for the image error
+    ShaderID splitSumErrorShaders[2] = {-1, -1};
+    bool depthPrepass = false;
+    // Fragments and GPU time of the depth pre-pass (or the guide pass) and
+    // of the shading pass
+    QueryID prepassSamplesQuery = -1;
+    QueryID prepassTimeQuery = -1;
+    QueryID opaqueSamplesQuery = -1;
+    QueryID opaqueTimeQuery = -1;
     TextureID envPanorama;
+    TextureID envOctahedral = -1; // Loaded on first use
+    TextureID envCubemap = -1;    // Loaded on first use
+    EnvironmentFormat environmentFormat = EnvironmentFormat::Panorama;
+    TextureID blueNoiseMask;
+    TextureID sampleBankTexture = -1; // Requires caps.floatTextures
+    struct {
+        UniformHandle<glm::mat4> mvp;
+        UniformHandle<glm::mat4> viewProjection;
+        UniformHandle<glm::mat4> model;
+        UniformHandle<glm::vec3> viewOrigin;
+        UniformHandle<int> env;
+        UniformHandle<glm::vec3> F0;
+        UniformHandle<glm::vec3> kd;
+        UniformHandle<float> roughness;
+        UniformHandle<float> gamma;
+        UniformHandle<glm::vec4> whs;
+        UniformHandle<float> targetError;
+        UniformHandle<int> sampleOffset;
+        UniformHandle<float> lodBias;
+        UniformHandle<float> filterSamples;
+        UniformHandle<float> texelSolidAngle;
+        UniformHandle<int> sampleBank;
+        UniformHandle<glm::vec2> sampleBankSize;
+        UniformHandle<int> blueNoise;
+        UniformHandle<glm::vec2> blueNoiseScale;
+        UniformHandle<float> blueNoiseOffset;
+        UniformHandle<int> fb;
+        UniformHandle<int> average;
+        UniformHandle<float> accumulationWeight;
+        UniformHandle<glm::vec2> uvScale;
+        UniformHandle<glm::vec2> uvOff;
+        UniformHandle<int> guide;
+        UniformHandle<glm::vec2> texelSize;
+        UniformHandle<float> stepWidth;
+        UniformHandle<float> sigmaColor;
+        UniformHandle<float> sigmaNormal;
+        UniformHandle<float> sigmaDepth;
+        UniformHandle<int> prefiltered;
+        UniformHandle<int> dfgLut;
+        UniformHandle<glm::vec4> prefilterSamples;
+    } uniforms;
+    // Material and sample table, if the platform has uniform buffers
+    UniformBufferID materialBuffer = -1;
+    UniformBufferID samplesBuffer = -1;
     float roughness = 0.05f;
-    float lod = 0.5f;
+    float lod = 1.f; // Bias added to each sample's filtered lod
     glm::vec3 F0 = glm::vec3(0.03f);
     glm::vec3 kd = glm::vec3(0.42f, 0.008f, 0.008f);
     float gamma = 1.f;
     int numSamples = 50;
-    std::vector<glm::vec3> whs;
+    // Adaptive sampling stops a pixel's loop once the relative standard error
+    // of its luminance drops below this, numSamples is the upper bound. 0 is off.
+    float targetError = 0.f;
+    // Rotate each pixel's samples by a blue-noise angle (see assets/bluenoise.tga)
+    bool blueNoise = false;
+    // Generate samples in mesh.fs (roughness may vary per pixel), the table
+    // path remains for platforms without highp fragment shaders
+    bool gpuSamples = false;
+    // Fetch samples from the bank texture, roughness only selects rows
+    bool sampleBank = false;
+    // Sample visible normals instead (per pixel, implies GPU sampling)
+    bool vndf = false;
+    ShadingMode shadingMode = ShadingMode::FilteredIS;
+    // Split sum, built on first use. The map is filtered with the lod bias
+    // too and rebuilt when it changes, unless it was baked offline
+    // (tools/prefilter.cpp).
+    TextureID prefilteredMap = -1;
+    FramebufferID prefilteredFramebuffer = -1;
+    float prefilteredLod = -1.f;
+    bool prefilteredBaked = false;
+    TextureID dfgLut = -1;
+    std::vector<glm::vec4> whs;
+
+    // Material grid, roughness varies along columns and F0 along rows.
+    // Drawn with one instanced draw call, 0 columns is off.
+    int gridColumns = 0;
+    int gridRows = 0;
+    InstanceBufferID gridInstances = -1;
+
+    // Progressive accumulation: while nothing changes, each frame draws a new
+    // set of samples (Halton index offset) into the float target, and one
+    // screen quad mixes it with the previous average into the other of two
+    // targets, so every pixel is added exactly once. No float blending,
+    // which WebGL 1.0 rarely has. Any setValue or camera move starts over.
+    bool accumulate = false;
+    int accumulatedFrames = 0;
+    // MaxAccumulatedFrames, fewer if the permutation runs out of samples
+    // (SAMPLE_BANK has SampleBankColumns in total)
+    int maxAccumulatedFrames = MaxAccumulatedFrames;
+    TextureID hdrTexture = -1; // This frame
+    RenderbufferID hdrDepth = -1;
+    FramebufferID hdrFramebuffer = -1;
+    // Running averages, frame n writes n % 2
+    TextureID accumulationTextures[2] = {-1, -1};
+    FramebufferID accumulationFramebuffers[2] = {-1, -1};
+
+    // Denoising: the mesh pass goes to the float target, an edge-avoiding
+    // a-trous filter guided by normals and distances (drawn first, sharing
+    // the depth buffer) cleans it up before tonemapping. Meant for low
+    // sample counts, e.g. 8 samples instead of 50 on slower GPUs.
+    bool denoise = false;
+    int denoiseIterations = 4;
+    float denoiseColor = 0.5f;   // Color sigma of the first iteration, halved by each next one
+    float denoiseNormal = 64.f;  // Exponent of the normals' cosine
+    float denoiseDepth = 0.05f;  // Sigma of the relative distance difference
+    TextureID guideTexture = -1;
+    FramebufferID guideFramebuffer = -1;
+    TextureID denoiseTextures[2] = {-1, -1};
+    FramebufferID denoiseFramebuffers[2] = {-1, -1};
+
+    // Measured along with the stats: average samples per covered pixel
+    // (adaptive) and share of valid samples (both sampling methods)
+    FramebufferID diagnosticsFramebuffer = -1;
+    float samplesPerPixel = 0.f;
+    float sampleRatios[2] = {0.f, 0.f};
+    float splitSumError = 0.f; // RMSE of the tonemapped 8-bit images
+
+    bool printStats = false;
+    double statsTime = 0.0;
+    int statsFrames = 0;
 
     std::string cmd, previousCmd;
 };
@@ -0,0 +1,12 @@
+varying vec2 vuv;
+uniform sampler2D fb;
+uniform sampler2D average;
+uniform float accumulationWeight; // 1/(n+1) for frame n
+
+// This frame's linear radiance mixed into the running average, from one
+// target into the other (see App::accumulateHdr)
+void main()
+{
+    vec3 c = mix(texture2D(average, vuv).rgb, texture2D(fb, vuv).rgb, accumulationWeight);
+    gl_FragColor = vec4(c, 1.0);
+}
@@ -0,0 +1,54 @@
+varying vec2 vuv;
+uniform sampler2D fb;    // Linear radiance
+uniform sampler2D guide; // Normal and distance, see guide.fs
+uniform vec2 texelSize;
+uniform float stepWidth;
+uniform float sigmaColor;
+uniform float sigmaNormal;
+uniform float sigmaDepth;
+
+// B3 spline, 1/16 [1 4 6 4 1]
+float getKernelWeight(int i)
+{
+    if (i == 0)
+        return 3.0/8.0;
+    return (i == 1 || i == -1)? 1.0/4.0 : 1.0/16.0;
+}
+
+// One iteration of the edge-avoiding a-trous wavelet filter (Dammertz et
+// al. 2010): 5x5 taps stepWidth texels apart, each weighted down by how
+// much its radiance, normal and distance differ from the center pixel.
+// Radiance is compared after a Reinhard curve, bright env texels would
+// otherwise never blend with anything.
+void main()
+{
+    vec3 center = texture2D(fb, vuv).rgb;
+    vec4 centerGuide = texture2D(guide, vuv);
+    if (centerGuide.w <= 0.0) {
+        // Background, nothing to denoise
+        gl_FragColor = vec4(center, 1.0);
+        return;
+    }
+    vec3 centerCompressed = center / (center + 1.0);
+
+    vec3 sum = vec3(0.0);
+    float weightSum = 0.0;
+    for (int j = -2; j <= 2; j++) {
+        for (int i = -2; i <= 2; i++) {
+            vec2 uv = vuv + vec2(float(i), float(j)) * stepWidth * texelSize;
+            vec3 color = texture2D(fb, uv).rgb;
+            vec4 tapGuide = texture2D(guide, uv);
+
+            vec3 colorDiff = color / (color + 1.0) - centerCompressed;
+            float wColor = exp(-dot(colorDiff, colorDiff) / (sigmaColor*sigmaColor));
+            float wNormal = pow(max(dot(tapGuide.xyz, centerGuide.xyz), 0.0), sigmaNormal);
+            float wDepth = exp(-abs(tapGuide.w - centerGuide.w) / (sigmaDepth * centerGuide.w));
+            // Background taps have a 0 normal, wNormal drops them
+            float weight = getKernelWeight(i) * getKernelWeight(j) * wColor * wNormal * wDepth;
+            sum += color * weight;
+            weightSum += weight;
+        }
+    }
+    // The center tap always has weight
+    gl_FragColor = vec4(sum / weightSum, 1.0);
+}
@@ -0,0 +1,5 @@
+// Depth pre-pass (with mesh.vs), color writes are off
+void main()
+{
+    gl_FragColor = vec4(0.0);
+}
@@ -1,11 +1,14 @@
 varying vec3 vnormal;
-uniform sampler2D env;
-uniform float gamma;
+uniform ENV_SAMPLER env; // See sampleEnvironment
 
 void main()
 {
     vec3 dir = normalize(vnormal);
-    vec3 linear = samplePanorama(env, dir, 0.5);
+    vec3 linear = sampleEnvironment(env, dir, 0.5);
+#ifdef HDR_OUTPUT
+    gl_FragColor = vec4(linear, 1.0);
+#else
     vec3 color = linear / (linear + 1.0);
     gl_FragColor.rgb = pow(color, vec3(1.0/gamma));
+#endif
 }
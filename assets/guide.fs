@@ -0,0 +1,9 @@
+varying vec3 vnormal;
+varying vec3 vview;
+
+// Denoiser guide (with mesh.vs): world space normal and distance to the
+// camera, the cleared 0 distance marks the background
+void main()
+{
+    gl_FragColor = vec4(normalize(vnormal), length(vview));
+}
@@ -1,28 +1,89 @@
 varying vec3 vnormal;
 varying vec3 vview;
+#ifdef INSTANCED
+// Per-instance material, overrides the Material block
+varying vec3 vF0;
+varying float vroughness;
+varying vec3 vkd;
+#endif
 
-uniform sampler2D env;
-uniform float gamma;
-// Sampling half-vectors wh can be done on the GPU, allowing
-// per-pixel variability.
-uniform vec3 whs[50];
+uniform ENV_SAMPLER env; // See sampleEnvironment
 
-uniform float roughness;
-uniform float lod;
-uniform vec3 kd;
-uniform vec3 F0;
+// Permutations (see App::selectShaders):
+//   NUM_SAMPLES  - compile-time sample count, so the loop can be unrolled
+//   MIRROR       - roughness ~ 0, a single lookup in the reflected direction
+//   DIFFUSE_ONLY - no specular layer (F0 == 0)
+//   INSTANCED    - material grid, per-instance material (sample table for roughness 1)
+//   HDR_OUTPUT   - linear radiance into a float target, tonemapped later (accumulation, denoising)
+//   ADAPTIVE     - NUM_SAMPLES is an upper bound, stop once the estimate is good enough
+//   SAMPLE_COUNT_OUTPUT - with ADAPTIVE, output samples taken / NUM_SAMPLES instead of color
+//   BLUE_NOISE   - per-pixel rotation of the sample set, noise instead of banding
+//   GPU_SAMPLES  - generate half-vectors and lods per pixel (sampling.part), no table
+//   SAMPLE_BANK  - fetch samples from a float texture built at startup, up to its width
+//                  (also over all accumulated frames)
+//   BAKED_SAMPLES - compile-time table for BAKED_LEVEL (bakedsamples.part), no upload
+//   VNDF         - with GPU_SAMPLES, sample visible normals for the pixel's view
+//   SAMPLE_RATIO_OUTPUT - output the share of samples above the horizon instead of color
+//   SPLIT_SUM    - no sampling, prefiltered radiance times the DFG table (prefiltered.part)
+#ifndef NUM_SAMPLES
+#define NUM_SAMPLES 50
+#endif
+
+#if defined(SPLIT_SUM)
+uniform sampler2D prefiltered;
+// See buildDfgLut, 16-bit scale and bias split into high and low bytes
+uniform sampler2D dfgLut;
+#elif defined(BAKED_SAMPLES)
+uniform float lodBias;
+#elif defined(GPU_SAMPLES) || defined(SAMPLE_BANK)
+// Per pixel, so roughness may vary across the surface
+uniform int sampleOffset; // First Halton index - 1, changes per accumulated frame
+uniform float lodBias;
+// Sample count the lods filter for, NUM_SAMPLES or all accumulated frames'
+// samples together (App::getFilterSamples)
+uniform float filterSamples;
+#ifdef GPU_SAMPLES
+uniform float texelSolidAngle; // getPanoramaTexelSolidAngle
+#else
+// See buildSampleBank, rows by roughness and columns by sample index
+uniform sampler2D sampleBank;
+uniform vec2 sampleBankSize; // Columns, rows
+#endif
+#else
+// Half-vectors wh sampled on the CPU, w is the sample's filtered lod
+// (from its pdf). A uniform buffer isn't limited by the uniform register budget.
+#ifdef HAS_UNIFORM_BUFFERS
+layout(std140) uniform Samples {
+    vec4 whs[NUM_SAMPLES];
+};
+#else
+uniform vec4 whs[NUM_SAMPLES];
+#endif
+#endif
 
 // WebGL GLSL requires constant loop indices!
-const int NumSamples = 50;
-const float PI = 3.14159265;
+const int NumSamples = NUM_SAMPLES;
+
+#ifdef ADAPTIVE
+// Relative standard error of the mean luminance to stop at (App::targetError)
+uniform float targetError;
+// First batch, variance isn't worth much below this
+const int MinSamples = 4;
+const vec3 Luminance = vec3(0.2126, 0.7152, 0.0722);
+#endif
+
+#ifdef BLUE_NOISE
+// Tileable mask from tools/bluenoise.cpp, wrapped (GL_REPEAT) over the screen
+uniform sampler2D blueNoise;
+uniform vec2 blueNoiseScale; // 1 / mask size
+uniform float blueNoiseOffset; // Changes per accumulated frame
+#endif
 
-vec3 lookupLi(vec3 wj, vec3 wn, vec3 wh)
+vec3 lookupLi(vec3 wj, float lod)
 {
-    // lod should depend on sample probability, but in
-    // practice it's very much empirical. Here we're
-    // allowing the user to change lod manually, so that
-    // aliasing when undersampling is clearly visible.
-    return samplePanorama(env, wj, lod);
+    // lod comes from the sample probability (computed on the CPU,
+    // including a user bias), texel size varies over the map though.
+    return sampleEnvironment(env, wj, lod + environmentLodBias(wj));
 }
 
 vec3 evaluateF(vec3 F0, float cosThetad)
@@ -40,40 +101,259 @@ float evaluateG(vec3 wj, vec3 wo, vec3 wh, vec3 wn, float roughness)
     return 2.0 * din * don / (1.0 + dio);
 }
 
+vec3 sampleSpecular(vec3 wh, vec3 wo, vec3 wn, float lod, vec3 F0, float roughness)
+{
+    vec3 wj = 2.0*dot(wh, wo)*wh - wo;
+    float eps = 0.01;
+    float djn = max(dot(wj, wn), eps);
+    float don = max(dot(wo, wn), eps);
+    float djh = max(dot(wj, wh), eps);
+    float dhn = max(dot(wh, wn), eps);
+    if (djn > eps) {
+        vec3 L = lookupLi(wj, lod);
+        vec3 F = evaluateF(F0, djh);
+        float G = evaluateG(wj, wo, wh, wn, roughness);
+        return L * G * djh / (don * dhn) * F;
+    }
+    return vec3(0.0);
+}
+
+#ifdef GPU_SAMPLES
+vec4 generateSample(int j, float roughness)
+{
+    vec3 wh = importanceSampleTrowbridgeReitz(getHalton23(sampleOffset + j + 1), roughness);
+    return vec4(wh, getFilteredLod(wh.z, roughness, filterSamples, texelSolidAngle) + lodBias);
+}
+#endif
+
+#ifdef VNDF
+// Sampling the distribution of visible normals (Heitz 2018), wo and the
+// result in tangent space. Half-vectors facing away from wo are never
+// generated, so far fewer reflections end up below the horizon.
+vec3 sampleVisibleNormal(vec3 wo, float alpha, vec2 u)
+{
+    // Stretch to the hemisphere configuration
+    vec3 vh = normalize(vec3(alpha*wo.x, alpha*wo.y, wo.z));
+    float lensq = vh.x*vh.x + vh.y*vh.y;
+    vec3 t1 = (lensq > 0.0)? vec3(-vh.y, vh.x, 0.0) / sqrt(lensq) : vec3(1.0, 0.0, 0.0);
+    vec3 t2 = cross(vh, t1);
+    // Point on the projected disk, warped to its visible half
+    float r = sqrt(u.x);
+    float phi = 2.0*PI*u.y;
+    float p1 = r*cos(phi);
+    float p2 = r*sin(phi);
+    float s = 0.5*(1.0 + vh.z);
+    p2 = (1.0-s)*sqrt(1.0 - p1*p1) + s*p2;
+    vec3 nh = p1*t1 + p2*t2 + sqrt(max(0.0, 1.0 - p1*p1 - p2*p2))*vh;
+    // Unstretch
+    return normalize(vec3(alpha*nh.x, alpha*nh.y, max(0.0, nh.z)));
+}
+
+// Smith Lambda for Trowbridge-Reitz, G1 = 1/(1+Lambda)
+float smithLambda(float cosTheta, float alpha)
+{
+    float cos2 = max(cosTheta*cosTheta, 1e-6);
+    float tan2 = (1.0 - cos2) / cos2;
+    return 0.5 * (-1.0 + sqrt(1.0 + alpha*alpha*tan2));
+}
+
+vec3 sampleSpecularVisible(vec3 wh, vec3 wo, vec3 wn, vec3 F0, float roughness, float lambdaO, float extraLod)
+{
+    vec3 wj = 2.0*dot(wh, wo)*wh - wo;
+    float eps = 0.01;
+    float djn = dot(wj, wn);
+    if (djn > eps) {
+        float don = max(dot(wo, wn), eps);
+        float dhn = max(dot(wh, wn), eps);
+        // pdf(wj) = G1(wo) D(wh) / (4 dot(wo, wn)), filtered as in getFilteredLod
+        float pdf = evaluateD(dhn, roughness) / ((1.0 + lambdaO) * 4.0 * don);
+        float lod = max(0.5*log2(1.0 / (filterSamples * max(pdf, 1e-6) * texelSolidAngle)), 0.0) + lodBias + extraLod;
+        vec3 L = lookupLi(wj, lod);
+        vec3 F = evaluateF(F0, max(dot(wj, wh), eps));
+        // Same BRDF as sampleSpecular (Kelemen-Kalos G), only the sampling
+        // differs: BRDF * cos / pdf reduces to F * G / G1(wo)
+        float G = evaluateG(wj, wo, wh, wn, roughness);
+        return L * F * G * (1.0 + lambdaO);
+    }
+    return vec3(0.0);
+}
+#endif
+
+#ifdef SAMPLE_BANK
+vec4 fetchSample(int j, float roughness)
+{
+    // Float textures are only guaranteed nearest filtering, blend the two
+    // closest roughness rows by hand
+    // Accumulation stops before the columns run out (App::selectShaders)
+    float column = mod(float(sampleOffset + j), sampleBankSize.x);
+    float row = roughness * (sampleBankSize.y - 1.0);
+    float row0 = min(floor(row), sampleBankSize.y - 2.0);
+    float u = (column + 0.5) / sampleBankSize.x;
+    vec4 s0 = texture2D(sampleBank, vec2(u, (row0 + 0.5) / sampleBankSize.y));
+    vec4 s1 = texture2D(sampleBank, vec2(u, (row0 + 1.5) / sampleBankSize.y));
+    vec4 s = mix(s0, s1, row - row0);
+    float lod = max(s.w - 0.5*log2(filterSamples), 0.0) + lodBias;
+    return vec4(normalize(s.xyz), lod);
+}
+#endif
+
+#if defined(INSTANCED) && !defined(GPU_SAMPLES) && !defined(SAMPLE_BANK)
+// The sample table was generated for roughness 1, where cos^2(theta) = 1-e2.
+// Map its half-vectors to another roughness (see importanceSampleTrowbridgeReitz)
+// and shift the filtered lod by the ratio of pdfs (both D/4).
+vec4 retargetSample(vec4 whLod, float roughness)
+{
+    float a2 = roughness*roughness;
+    float cos2Theta1 = whLod.z*whLod.z;
+    float cos2Theta = cos2Theta1 / (1.0 + (a2-1.0)*(1.0-cos2Theta1));
+    float cosTheta = sqrt(cos2Theta);
+    float sinTheta = sqrt(1.0 - cos2Theta);
+    vec2 azimuth = whLod.xy / max(sqrt(1.0 - cos2Theta1), 1e-6);
+    float lod = whLod.w + 0.5*log2(evaluateD(whLod.z, 1.0) / evaluateD(cosTheta, roughness));
+    return vec4(azimuth*sinTheta, cosTheta, max(lod, 0.0));
+}
+#endif
+
 void main()
 {
+#ifdef BAKED_SAMPLES
+    loadBakedSamples();
+#endif
     vec3 wn = normalize(vnormal);
     vec3 wo = normalize(vview);
 
+#ifdef INSTANCED
+    vec3 materialF0 = vF0;
+    float materialRoughness = vroughness;
+    vec3 materialKd = vkd;
+#else
+    vec3 materialF0 = F0;
+    float materialRoughness = roughness;
+    vec3 materialKd = kd;
+#endif
+
+#if defined(DIFFUSE_ONLY)
+    vec3 spec = vec3(0.0);
+#elif defined(MIRROR)
+    // Every half-vector collapses to the normal
+    vec3 spec = sampleSpecular(wn, wo, wn, whs[0].w, materialF0, materialRoughness);
+#elif defined(SPLIT_SUM)
+    // Radiance prefiltered for the lobe assuming wo == wn, times the
+    // integral of the BRDF for this view and roughness
+    vec3 wr = 2.0*dot(wo, wn)*wn - wo;
+    vec4 dfg = texture2D(dfgLut, vec2(max(dot(wo, wn), 0.01), materialRoughness));
+    vec2 scaleBias = dfg.rb + dfg.ga / 255.0;
+    vec3 spec = samplePrefiltered(prefiltered, wr, materialRoughness) * (materialF0*scaleBias.x + scaleBias.y);
+#else
     // Pick a tangent space
     vec3 worldUp = vec3(0.0, 1.0, 0.0);
     vec3 tangent = normalize(cross(worldUp, wn));
     vec3 bitangent = cross(wn, tangent);
+#ifdef BLUE_NOISE
+    // Cranley-Patterson rotation of the Halton azimuth, the same for all
+    // samples of a pixel. Importance sampling takes phi from u1 (e12.x,
+    // u2 picks theta), turning the frame adds to it and lods don't change.
+    // VNDF rotates u2, its disk azimuth, in the loop below.
+    float noise = texture2D(blueNoise, gl_FragCoord.xy * blueNoiseScale).r;
+    float rotation = fract(noise + blueNoiseOffset);
+    float phi = 2.0*PI * rotation;
+    tangent = cos(phi)*tangent + sin(phi)*bitangent;
+    bitangent = cross(wn, tangent);
+#endif
 
     vec3 spec = vec3(0.0);
+    float sampleCount = 0.0;
+#ifdef SAMPLE_RATIO_OUTPUT
+    float validSamples = 0.0;
+#endif
+#ifdef VNDF
+    // The per-view transform, once per pixel
+    vec3 woTangent = vec3(dot(wo, tangent), dot(wo, bitangent), max(dot(wo, wn), 0.01));
+    float lambdaO = smithLambda(woTangent.z, materialRoughness);
+#endif
+    // Added to every sample's lod, see below
+    float batchLod = 0.0;
+#ifdef ADAPTIVE
+    // Running mean and sum of squared differences (Welford)
+    float meanL = 0.0;
+    float m2 = 0.0;
+    // Lods are filtered for NumSamples, stopping after k samples would leave
+    // each footprint 0.5*log2(NumSamples/k) levels too small and alias.
+    // Samples come in batches (MinSamples, then doubling) instead, the loop
+    // only stops at the end of one, and each sample is filtered for the
+    // count at the end of its batch. Earlier batches end up a bit blurrier.
+    float batchEnd = min(float(MinSamples), float(NumSamples));
+#endif
     for (int j = 0; j < NumSamples; j++) {
-        vec3 wh = whs[j];
-        wh = tangent * wh.x + bitangent * wh.y + wn * wh.z; // To world space
-        vec3 wj = 2.0*dot(wh, wo)*wh - wo;
-        float eps = 0.01;
-        float djn = max(dot(wj, wn), eps);
-        float don = max(dot(wo, wn), eps);
-        float djh = max(dot(wj, wh), eps);
-        float dhn = max(dot(wh, wn), eps);
-        if (djn > eps) {
-            vec3 L = lookupLi(wj, wn, wh);
-            vec3 F = evaluateF(F0, djh);
-            float G = evaluateG(wj, wo, wh, wn, roughness);
-            spec += L * G * djh / (don * dhn) * F;
+#ifdef ADAPTIVE
+        batchLod = 0.5*log2(float(NumSamples) / batchEnd);
+#endif
+#if defined(VNDF)
+        vec2 u = getHalton23(sampleOffset + j + 1);
+#ifdef BLUE_NOISE
+        // VNDF samples are placed around wo, which turns with the frame, so
+        // the rotation goes into the disk's azimuth instead
+        u.y = fract(u.y + rotation);
+#endif
+        vec3 whTangent = sampleVisibleNormal(woTangent, materialRoughness, u);
+        vec3 wh = tangent * whTangent.x + bitangent * whTangent.y + wn * whTangent.z;
+        vec3 Lj = sampleSpecularVisible(wh, wo, wn, materialF0, materialRoughness, lambdaO, batchLod);
+#else
+#if defined(GPU_SAMPLES)
+        vec4 whLod = generateSample(j, materialRoughness);
+#elif defined(SAMPLE_BANK)
+        vec4 whLod = fetchSample(j, materialRoughness);
+#else
+        vec4 whLod = whs[j];
+#ifdef BAKED_SAMPLES
+        whLod.w += lodBias; // Baked without bias
+#endif
+#ifdef INSTANCED
+        whLod = retargetSample(whLod, materialRoughness);
+#endif
+#endif
+        vec3 wh = tangent * whLod.x + bitangent * whLod.y + wn * whLod.z; // To world space
+        vec3 Lj = sampleSpecular(wh, wo, wn, whLod.w + batchLod, materialF0, materialRoughness);
+#endif
+        // Samples below the horizon still count, they are zero-valued
+        spec += Lj;
+        sampleCount += 1.0;
+#ifdef SAMPLE_RATIO_OUTPUT
+        validSamples += (dot(2.0*dot(wh, wo)*wh - wo, wn) > 0.01)? 1.0 : 0.0;
+#endif
+#ifdef ADAPTIVE
+        float l = dot(Lj, Luminance);
+        float delta = l - meanL;
+        meanL += delta / sampleCount;
+        m2 += delta * (l - meanL);
+        // Halton prefixes stay well stratified, so stopping early is fine.
+        // var/n <= (error*mean)^2, near-mirror lobes get here right away.
+        if (sampleCount == batchEnd) {
+            if (m2 / (sampleCount-1.0) / sampleCount <= targetError*targetError * max(meanL*meanL, 1e-6))
+                break;
+            batchEnd = min(2.0*batchEnd, float(NumSamples));
         }
+#endif
     }
-    spec /= float(NumSamples);
+    spec /= sampleCount;
+
+#if defined(SAMPLE_COUNT_OUTPUT)
+    gl_FragColor = vec4(sampleCount / float(NumSamples), 0.0, 0.0, 1.0);
+    return;
+#elif defined(SAMPLE_RATIO_OUTPUT)
+    gl_FragColor = vec4(validSamples / sampleCount, 0.0, 0.0, 1.0);
+    return;
+#endif
+#endif
 
-    vec3 lambert = (kd/PI) * samplePanorama(env, wn, 5.0); // Most blurred mip is a good approximation of irradiance
+    vec3 lambert = (materialKd/PI) * sampleEnvironment(env, wn, 5.0); // Most blurred mip is a good approximation of irradiance
     vec3 linear = lambert + spec;
 
+#ifdef HDR_OUTPUT
+    gl_FragColor = vec4(linear, 1.0);
+#else
     // Reinhard (global)
     vec3 color = linear / (linear + 1.0);
-    vec3 unused = wn + wo + kd + F0*roughness + whs[0];
-    gl_FragColor.rgb = unused*0.000001 + pow(color, vec3(1.0/gamma));
+    gl_FragColor = vec4(pow(color, vec3(1.0/gamma)), 1.0); // Alpha marks coverage for the diagnostics
+#endif
 }
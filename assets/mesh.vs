@@ -1,16 +1,42 @@
 attribute vec3 position;
 attribute vec3 normal;
+// Attributes are bound in declaration order, instance attributes take
+// locations 2-7 (see Instance in renderer.hpp)
+attribute vec4 instanceModel0;
+attribute vec4 instanceModel1;
+attribute vec4 instanceModel2;
+attribute vec4 instanceModel3;
+attribute vec4 instanceF0Roughness;
+attribute vec4 instanceKd;
 
-uniform mat4 mvp;
+// The depth pre-pass uses this shader too, depths must match exactly
+invariant gl_Position;
+
+uniform mat4 viewProjection;
 uniform vec3 viewOrigin;
+#ifndef INSTANCED
+uniform mat4 model;
+#endif
 
 varying vec3 vnormal;
 varying vec3 vview;
+#ifdef INSTANCED
+varying vec3 vF0;
+varying float vroughness;
+varying vec3 vkd;
+#endif
 
 void main()
 {
-    // There is no model transform!
-    vnormal = normal;
-    vview = viewOrigin - position;
-    gl_Position = mvp * vec4(position, 1.0);
+#ifdef INSTANCED
+    mat4 model = mat4(instanceModel0, instanceModel1, instanceModel2, instanceModel3);
+    vF0 = instanceF0Roughness.xyz;
+    vroughness = instanceF0Roughness.w;
+    vkd = instanceKd.xyz;
+#endif
+    // Uniform scale and translation only, normals don't need the inverse transpose
+    vec4 worldPosition = model * vec4(position, 1.0);
+    vnormal = (model * vec4(normal, 0.0)).xyz;
+    vview = viewOrigin - worldPosition.xyz;
+    gl_Position = viewProjection * worldPosition;
 }
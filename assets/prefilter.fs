@@ -0,0 +1,31 @@
+varying vec2 vuv;
+uniform ENV_SAMPLER env; // See sampleEnvironment
+// Half-vectors for the level's roughness, w is the filtered lod
+uniform vec4 prefilterSamples[NUM_SAMPLES];
+
+const int NumSamples = NUM_SAMPLES;
+
+// One level of the split-sum radiance map (with prefiltered.part), drawn
+// into the level's viewport. Filtered importance sampling of the environment
+// with wo == wr == wn, weighted by the cosine (Karis 2013).
+void main()
+{
+    vec3 wn = getLatLongDir(vuv);
+    vec3 worldUp = (abs(wn.y) < 0.999)? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+    vec3 tangent = normalize(cross(worldUp, wn));
+    vec3 bitangent = cross(wn, tangent);
+
+    vec3 sum = vec3(0.0);
+    float weightSum = 0.0;
+    for (int j = 0; j < NumSamples; j++) {
+        vec4 whLod = prefilterSamples[j];
+        vec3 wh = tangent * whLod.x + bitangent * whLod.y + wn * whLod.z;
+        vec3 wj = 2.0*dot(wh, wn)*wh - wn;
+        float djn = dot(wj, wn);
+        if (djn > 0.0) {
+            sum += sampleEnvironment(env, wj, whLod.w + environmentLodBias(wj)) * djn;
+            weightSum += djn;
+        }
+    }
+    gl_FragColor = encodeRgbm(sum / max(weightSum, 1e-6));
+}
@@ -1,10 +1,13 @@
 varying vec2 vuv;
 uniform sampler2D fb;
+uniform vec2 uvScale;
 uniform vec2 uvOff;
-uniform float gamma;
 
+// Linear radiance in fb (e.g. the accumulated HDR target), same
+// operator as the direct path in mesh.fs and env.fs
 void main()
 {
-    vec3 linear = texture2D(fb, vuv*vec2(0.5, 1.0) + uvOff).rgb;
-    gl_FragColor = vec4(pow(linear, vec3(1.0 / gamma)), 0.0);
+    vec3 linear = texture2D(fb, vuv*uvScale + uvOff).rgb;
+    vec3 color = linear / (linear + 1.0);
+    gl_FragColor = vec4(pow(color, vec3(1.0 / gamma)), 1.0);
 }
@@ -9,19 +9,23 @@
 #include <sstream>
 #include <algorithm>
 #include <iterator>
-#include <unordered_map>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <atomic>
+#include <thread>
 
 struct Mesh {
     GLuint vbid;
     GLuint ibid;
+    GLuint vao; // 0 without caps.vertexArrays
     GLsizei numIndices;
 };
 
 struct Shader {
     GLuint id;
-    std::unordered_map<std::string, GLint> uniforms;
+    std::vector<GLint> locations; // By uniform slot, -1 if inactive
+    std::vector<ByteBuffer> values; // Last uploaded value by slot
 };
 
 struct Texture {
@@ -38,6 +42,57 @@ struct Renderbuffer {
     GLuint id;
 };
 
+struct UniformBuffer {
+    GLuint id;
+    GLuint binding;
+    std::string blockName;
+    ByteBuffer contents; // Last uploaded data
+};
+
+struct InstanceBuffer {
+    GLuint id;
+    int count; // Instances uploaded
+};
+
+struct Query {
+    GLuint id;
+    GLenum target;
+    bool active;  // Between begin and end this frame
+    bool pending; // Waiting for the result
+    u64 result;
+};
+
+// Next mip level of tightly packed 8-bit texels, 2x2 average as glGenerateMipmap
+// would do. Odd sizes repeat the last row or column.
+static std::vector<u8> downsampleTexels(const std::vector<u8>& texels, int& width, int& height, int numChannels)
+{
+    const int sourceWidth = width;
+    const int sourceHeight = height;
+    width = std::max(width/2, 1);
+    height = std::max(height/2, 1);
+    std::vector<u8> result(width * height * numChannels);
+    for (int y = 0; y < height; y++) {
+        const int y0 = std::min(2*y, sourceHeight-1) * sourceWidth;
+        const int y1 = std::min(2*y + 1, sourceHeight-1) * sourceWidth;
+        for (int x = 0; x < width; x++) {
+            const int x0 = std::min(2*x, sourceWidth-1);
+            const int x1 = std::min(2*x + 1, sourceWidth-1);
+            for (int c = 0; c < numChannels; c++) {
+                const int sum = texels[(y0 + x0)*numChannels + c] + texels[(y0 + x1)*numChannels + c] +
+                                texels[(y1 + x0)*numChannels + c] + texels[(y1 + x1)*numChannels + c];
+                result[(y * width + x) * numChannels + c] = static_cast<u8>((sum + 2) / 4);
+            }
+        }
+    }
+    return result;
+}
+
+static bool hasExtension(const char* name)
+{
+    const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+    return extensions != nullptr && std::strstr(extensions, name) != nullptr;
+}
+
 void checkGLError(const char* file, int line)
 {
     const GLenum error = glGetError();
@@ -65,9 +120,80 @@ Renderer::Renderer(int canvasWidth, int canvasHeight)
     };
 
     glGenBuffers(1, &quadVB);
-    glBindBuffer(GL_ARRAY_BUFFER, quadVB);
+    bindBuffer(GL_ARRAY_BUFFER, quadVB);
     glBufferData(GL_ARRAY_BUFFER, sizeof(quadIndices), quadIndices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    detectCaps();
+
+    if (caps.vertexArrays) {
+        glGenVertexArrays(1, &quadVAO);
+        bindVertexArray(quadVAO);
+        glEnableVertexAttribArray(0);
+        specifyQuadAttribs();
+        bindVertexArray(0);
+    }
+}
+
+void Renderer::detectCaps()
+{
+#ifdef EMSCRIPTEN
+    caps.vertexArrays = hasExtension("OES_vertex_array_object");
+    caps.instancing   = hasExtension("ANGLE_instanced_arrays");
+    caps.floatTextures = hasExtension("OES_texture_float");
+    // Rendering to them is an extension of its own in WebGL 1.0
+    caps.floatTargets = caps.floatTextures &&
+        (hasExtension("WEBGL_color_buffer_float") || hasExtension("EXT_color_buffer_float"));
+    // Highp is optional in WebGL 1.0 fragment shaders
+    GLint range[2], precision = 0;
+    glGetShaderPrecisionFormat(GL_FRAGMENT_SHADER, GL_HIGH_FLOAT, range, &precision);
+    caps.fragmentHighp = precision >= 23;
+    if (hasExtension("EXT_shader_texture_lod")) {
+        caps.textureLod = true;
+        shaderPrologue += "#extension GL_EXT_shader_texture_lod : enable\n"
+                          "#define HAS_TEXTURE_LOD 1\n"
+                          "#define TEXTURE_2D_LOD texture2DLodEXT\n"
+                          "#define TEXTURE_CUBE_LOD textureCubeLodEXT\n";
+    }
+#else
+    // GLSL 1.20 (GL 2.1) for invariant, has to come before the extensions
+    shaderPrologue += "#version 120\n";
+    caps.vertexArrays = hasExtension("GL_ARB_vertex_array_object");
+    caps.instancing   = hasExtension("GL_ARB_instanced_arrays") && hasExtension("GL_ARB_draw_instanced");
+    caps.occlusionQueries = true; // Core since GL 1.5
+    caps.timerQueries = hasExtension("GL_ARB_timer_query");
+    caps.floatTextures = hasExtension("GL_ARB_texture_float");
+    caps.floatTargets = caps.floatTextures;
+
+    // WebGL 1.0 has none of these
+    if (hasExtension("GL_ARB_uniform_buffer_object")) {
+        caps.uniformBuffers = true;
+        shaderPrologue += "#extension GL_ARB_uniform_buffer_object : enable\n"
+                          "#define HAS_UNIFORM_BUFFERS 1\n";
+    }
+    // Core in GL 3.0 (GLSL 1.30)
+    if (hasExtension("GL_EXT_gpu_shader4")) {
+        caps.integerOps = true;
+        shaderPrologue += "#extension GL_EXT_gpu_shader4 : enable\n"
+                          "#define HAS_INTEGER_OPS 1\n";
+    }
+    // GLSL 1.10 only has texture2DLod in vertex shaders
+    if (hasExtension("GL_ARB_shader_texture_lod")) {
+        caps.textureLod = true;
+        shaderPrologue += "#extension GL_ARB_shader_texture_lod : enable\n"
+                          "#define HAS_TEXTURE_LOD 1\n"
+                          "#define TEXTURE_2D_LOD texture2DLod\n"
+                          "#define TEXTURE_CUBE_LOD textureCubeLod\n";
+    }
+#endif
+
+    std::cout << "Uniform buffers: " << (caps.uniformBuffers ? "yes" : "no") << std::endl;
+    std::cout << "Vertex arrays: "   << (caps.vertexArrays   ? "yes" : "no") << std::endl;
+    std::cout << "Instancing: "      << (caps.instancing     ? "yes" : "no") << std::endl;
+    std::cout << "Timer queries: "   << (caps.timerQueries   ? "yes" : "no") << std::endl;
+    std::cout << "Float targets: "   << (caps.floatTargets   ? "yes" : "no") << std::endl;
+    std::cout << "Integer ops: "     << (caps.integerOps     ? "yes" : "no") << std::endl;
+    std::cout << "Fragment highp: "  << (caps.fragmentHighp  ? "yes" : "no") << std::endl;
+    std::cout << "Texture lod: "     << (caps.textureLod     ? "yes" : "no") << std::endl;
 }
 
 Renderer::~Renderer()
@@ -91,14 +217,27 @@ Renderer::~Renderer()
     for (Framebuffer* framebuffer: framebuffers) {
         delete framebuffer;
     }
+
+    for (UniformBuffer* buffer: uniformBuffers) {
+        delete buffer;
+    }
+
+    for (InstanceBuffer* buffer: instanceBuffers) {
+        delete buffer;
+    }
+
+    for (Query* query: queries) {
+        delete query;
+    }
 }
 
 ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::string& fsSource)
 {
     assert(fsSource.size() > 0);
-    std::string vsSourceFinal = vsSource;
+    std::string vsSourceFinal = shaderPrologue + vsSource;
     if (vsSource.size() == 0) {
-        vsSourceFinal = std::string("attribute float index;\n") +
+        vsSourceFinal = shaderPrologue +
+                        "attribute float index;\n" +
                         "uniform vec2 uv[4];\n" +
                         "varying vec2 vuv;\n" +
                         "void main(){\n" +
@@ -113,7 +252,7 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
         "precision mediump float;\n" +
         "#endif\n" +
         "#endif\n";
-    std::string fsSourceFinal = fsHeader + fsSource;
+    std::string fsSourceFinal = shaderPrologue + fsHeader + fsSource;
     GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
     GLuint ids[2];
     for (int i = 0; i < 2; i++) {
@@ -134,7 +273,6 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
     }
 
     std::vector<std::string> attributes;
-    std::vector<std::string> uniforms;
     for (int i = 0; i < 2; i++) {
         std::stringstream ss;
         if (i == 0)
@@ -146,13 +284,7 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
         ss >> token;
         // This is very fragile!
         while (token != "main" && !ss.eof()) {
-            if (token == "uniform") {
-                std::string type, name;
-                ss >> type >> name;
-                name = name.substr(0, name.find_first_of("[ ;"));
-                uniforms.push_back(name);
-            }
-            else if (token == "attribute") {
+            if (token == "attribute") {
                 std::string type, name;
                 ss >> type >> name;
                 name = name.substr(0, name.find_first_of("[ ;"));
@@ -174,105 +306,226 @@ ShaderID Renderer::addShaderFromSource(const std::string& vsSource, const std::s
     GLint linked = 0;
     glGetProgramiv(shader->id, GL_LINK_STATUS, &linked);
     assert(linked);
-    for (std::string name : uniforms) {
-        shader->uniforms[name] = glGetUniformLocation(shader->id, name.c_str());
-        if (shader->uniforms[name] == -1) {
-            std::cout << "Failed to get uniform " << name << " location!" << std::endl;
-            assert(false);
-        }
-    }
+    resolveUniformLocations(shader);
+    bindUniformBlocks(shader);
 
     shaders.push_back(shader);
     return shaders.size()-1;
 }
 
-ShaderID Renderer::addShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles)
+ShaderID Renderer::addShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles,
+                             const std::vector<std::string>& defines)
+{
+    std::string key;
+    for (const std::string& file: vsFiles) {
+        key += file + ";";
+    }
+    key += "|";
+    for (const std::string& file: fsFiles) {
+        key += file + ";";
+    }
+    key += "|";
+    for (const std::string& define: defines) {
+        key += define + ";";
+    }
+    auto cached = shaderCache.find(key);
+    if (cached != shaderCache.end())
+        return cached->second;
+
+    const ShaderID id = loadShader(vsFiles, fsFiles, defines);
+    if (id == -1)
+        return -1;
+
+    ShaderTrackingInfo info;
+    info.vsFilenames = vsFiles;
+    info.fsFilenames = fsFiles;
+    info.defines = defines;
+    u64 modTime = 0;
+    for (const std::string& name: vsFiles) {
+        modTime = std::max(modTime, getFileModificationTime(name));
+    }
+    for (const std::string& name: fsFiles) {
+        modTime = std::max(modTime, getFileModificationTime(name));
+    }
+    info.lastModificationTime = modTime;
+    trackedShaderFiles[id] = info;
+    shaderCache[key] = id;
+    return id;
+}
+
+ShaderID Renderer::loadShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles,
+                              const std::vector<std::string>& defines)
 {
     std::stringstream ss;
     ss << "Uploading shaders: ";
     std::copy(vsFiles.begin(), vsFiles.end(), std::ostream_iterator<std::string>(ss, " "));
     ss << "+ ";
     std::copy(fsFiles.begin(), fsFiles.end(), std::ostream_iterator<std::string>(ss, " "));
+    if (!defines.empty()) {
+        ss << "with ";
+        std::copy(defines.begin(), defines.end(), std::ostream_iterator<std::string>(ss, ", "));
+    }
     std::cout << ss.str() << std::endl;
 
+    ByteBuffer definesSource = "";
+    for (const std::string& define: defines) {
+        definesSource += "#define " + define + "\n";
+    }
+
     ByteBuffer vsSource = "";
-    ByteBuffer fsSource = "";
+    ByteBuffer fsSource = definesSource;
     for (const std::string& file: vsFiles) {
         vsSource += getFileContents(file) + "\n";
     }
     for (const std::string& file: fsFiles) {
         fsSource += getFileContents(file) + "\n";
     }
-    const ShaderID id = addShaderFromSource(vsSource, fsSource);
-    if (!dontAddToTrackedFiles) {
-        ShaderTrackingInfo info;
-        info.vsFilenames = vsFiles;
-        info.fsFilenames = fsFiles;
-        u64 modTime = 0;
-        for (const std::string& name: vsFiles) {
-            modTime = std::max(modTime, getFileModificationTime(name));
-        }
-        for (const std::string& name: fsFiles) {
-            modTime = std::max(modTime, getFileModificationTime(name));
-        }
-        info.lastModificationTime = modTime;
-        trackedShaderFiles[id] = info;
-    }
-    return id;
+    // Empty vertex source selects the default screen quad shader
+    if (!vsSource.empty())
+        vsSource = definesSource + vsSource;
+    return addShaderFromSource(vsSource, fsSource);
 }
 
 void Renderer::setShader(ShaderID shader)
 {
     assert(shader >= 0 && shader < shaders.size());
-    glUseProgram(shaders[shader]->id);
+    useProgram(shaders[shader]->id);
     currentShader = shader;
 }
 
+int Renderer::getUniformSlot(const std::string& name)
+{
+    auto it = uniformSlots.find(name);
+    if (it != uniformSlots.end())
+        return it->second;
+
+    const int slot = uniformNames.size();
+    uniformNames.push_back(name);
+    uniformSlots[name] = slot;
+    for (Shader* shader: shaders) {
+        shader->locations.push_back(glGetUniformLocation(shader->id, name.c_str()));
+        shader->values.push_back(ByteBuffer());
+    }
+    return slot;
+}
+
+void Renderer::resolveUniformLocations(Shader* shader)
+{
+    // Uniforms can be compiled out by permutation defines (or simply
+    // unused), setting an inactive uniform (location -1) is a no-op
+    shader->locations.resize(uniformNames.size());
+    shader->values.resize(uniformNames.size());
+    for (int i = 0; i < uniformNames.size(); i++) {
+        shader->locations[i] = glGetUniformLocation(shader->id, uniformNames[i].c_str());
+    }
+}
+
+GLint Renderer::getUniformLocation(int slot) const
+{
+    assert(currentShader >= 0 && currentShader < shaders.size());
+    const Shader* shader = shaders[currentShader];
+    assert(slot >= 0 && slot < shader->locations.size());
+    return shader->locations[slot];
+}
+
+bool Renderer::isUniformDirty(GLint location, int slot, const void* data, size_t size)
+{
+    // Uniform values are per program state, skip uploads of unchanged bytes
+    if (location == -1)
+        return false;
+    ByteBuffer& value = shaders[currentShader]->values[slot];
+    if (value.size() == size && std::memcmp(&value[0], data, size) == 0) {
+        stats.uniformUploadsElided++;
+        return false;
+    }
+    value.assign(static_cast<const char*>(data), size);
+    stats.uniformUploads++;
+    return true;
+}
+
+void Renderer::setUniform(UniformHandle<int> handle, int value)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, &value, sizeof(value)))
+        glUniform1i(location, value);
+}
+
+void Renderer::setUniform(UniformHandle<float> handle, float value)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, &value, sizeof(value)))
+        glUniform1f(location, value);
+}
+
+void Renderer::setUniform(UniformHandle<glm::vec2> handle, const glm::vec2* values, int count)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, values, count*sizeof(glm::vec2)))
+        glUniform2fv(location, count, &values[0][0]);
+}
+
+void Renderer::setUniform(UniformHandle<glm::vec3> handle, const glm::vec3* values, int count)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, values, count*sizeof(glm::vec3)))
+        glUniform3fv(location, count, &values[0][0]);
+}
+
+void Renderer::setUniform(UniformHandle<glm::vec4> handle, const glm::vec4* values, int count)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, values, count*sizeof(glm::vec4)))
+        glUniform4fv(location, count, &values[0][0]);
+}
+
+void Renderer::setUniform(UniformHandle<glm::mat4> handle, const glm::mat4* values, int count)
+{
+    const GLint location = getUniformLocation(handle.slot);
+    if (isUniformDirty(location, handle.slot, values, count*sizeof(glm::mat4)))
+        glUniformMatrix4fv(location, count, GL_FALSE, &values[0][0][0]);
+}
+
 void Renderer::setUniform1i(const std::string& name, int value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniform1i(shader->uniforms[name], value);
+    setUniform(getUniform<int>(name), value);
 }
 
 void Renderer::setUniform1f(const std::string& name, float value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniform1f(shader->uniforms[name], value);
+    setUniform(getUniform<float>(name), value);
 }
 
 void Renderer::setUniform4x4fv(const std::string& name, int count, const float* value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniformMatrix4fv(shader->uniforms[name], count, GL_FALSE, value);
+    setUniform(getUniform<glm::mat4>(name), reinterpret_cast<const glm::mat4*>(value), count);
 }
 
 void Renderer::setUniform3fv(const std::string& name, int count, const float* value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniform3fv(shader->uniforms[name], count, value);
+    setUniform(getUniform<glm::vec3>(name), reinterpret_cast<const glm::vec3*>(value), count);
 }
 
 void Renderer::setUniform4fv(const std::string& name, int count, const float* value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniform4fv(shader->uniforms[name], count, value);
+    setUniform(getUniform<glm::vec4>(name), reinterpret_cast<const glm::vec4*>(value), count);
 }
 
 void Renderer::setUniform2fv(const std::string& name, int count, const float* value)
 {
-    Shader* shader = shaders[currentShader];
-    assert(shader->uniforms.find(name) != shader->uniforms.end());
-    glUniform2fv(shader->uniforms[name], count, value);
+    setUniform(getUniform<glm::vec2>(name), reinterpret_cast<const glm::vec2*>(value), count);
 }
 
 void Renderer::setViewport(int x, int y, int width, int height)
 {
-    glViewport(x, y, width, height);
+    int* viewport = state.viewport;
+    const bool dirty = viewport[0] != x || viewport[1] != y || viewport[2] != width || viewport[3] != height;
+    if (isStateDirty(dirty)) {
+        glViewport(x, y, width, height);
+        viewport[0] = x;
+        viewport[1] = y;
+        viewport[2] = width;
+        viewport[3] = height;
+    }
 }
 
 void Renderer::setTexture(int unit, TextureID id)
@@ -280,11 +533,120 @@ void Renderer::setTexture(int unit, TextureID id)
     assert(unit >= 0);
     assert(id >= 0 && id < textures.size());
     Texture* texture = textures[id];
-    glActiveTexture(GL_TEXTURE0+unit);
-    if (texture->isCubemap)
-        glBindTexture(GL_TEXTURE_CUBE_MAP, texture->id);
+    bindTexture(unit, texture->isCubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D, texture->id);
+}
+
+void Renderer::setDepthTest(bool enable)
+{
+    setCapability(GL_DEPTH_TEST, state.depthTest, enable);
+}
+
+void Renderer::setDepthFunc(DepthFunc func)
+{
+    if (isStateDirty(state.depthFunc != func)) {
+        glDepthFunc((func == DepthFunc::Equal) ? GL_EQUAL : GL_LESS);
+        state.depthFunc = func;
+    }
+}
+
+void Renderer::setDepthWrite(bool enable)
+{
+    if (isStateDirty(state.depthWrite != enable)) {
+        glDepthMask(enable ? GL_TRUE : GL_FALSE);
+        state.depthWrite = enable;
+    }
+}
+
+void Renderer::setColorWrite(bool enable)
+{
+    if (isStateDirty(state.colorWrite != enable)) {
+        const GLboolean mask = enable ? GL_TRUE : GL_FALSE;
+        glColorMask(mask, mask, mask, mask);
+        state.colorWrite = enable;
+    }
+}
+
+void Renderer::setCulling(bool enable)
+{
+    setCapability(GL_CULL_FACE, state.culling, enable);
+}
+
+bool Renderer::isStateDirty(bool dirty)
+{
+    if (dirty)
+        stats.stateChanges++;
     else
-        glBindTexture(GL_TEXTURE_2D, texture->id);
+        stats.stateChangesSkipped++;
+    return dirty;
+}
+
+void Renderer::useProgram(GLuint program)
+{
+    if (isStateDirty(state.program != program)) {
+        glUseProgram(program);
+        state.program = program;
+    }
+}
+
+void Renderer::bindVertexArray(GLuint vertexArray)
+{
+    if (isStateDirty(state.vertexArray != vertexArray)) {
+        glBindVertexArray(vertexArray);
+        state.vertexArray = vertexArray;
+    }
+}
+
+void Renderer::bindBuffer(GLenum target, GLuint buffer)
+{
+    assert(target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
+    // The element buffer binding belongs to the bound VAO
+    assert(target == GL_ARRAY_BUFFER || state.vertexArray == 0);
+    GLuint& current = (target == GL_ARRAY_BUFFER) ? state.arrayBuffer : state.elementBuffer;
+    if (isStateDirty(current != buffer)) {
+        glBindBuffer(target, buffer);
+        current = buffer;
+    }
+}
+
+void Renderer::bindTexture(int unit, GLenum target, GLuint texture)
+{
+    assert(unit >= 0 && unit < MaxTextureUnits);
+    assert(target == GL_TEXTURE_2D || target == GL_TEXTURE_CUBE_MAP);
+    GLuint& current = (target == GL_TEXTURE_2D) ? state.textures2D[unit] : state.texturesCube[unit];
+    if (isStateDirty(current != texture)) {
+        if (state.activeTextureUnit != unit) {
+            glActiveTexture(GL_TEXTURE0+unit);
+            state.activeTextureUnit = unit;
+        }
+        glBindTexture(target, texture);
+        current = texture;
+    }
+}
+
+void Renderer::enableVertexAttribs(int count)
+{
+    assert(count <= MaxVertexAttribs);
+    for (int i = 0; i < MaxVertexAttribs; i++) {
+        const bool enable = i < count;
+        if (isStateDirty(state.vertexAttribs[i] != enable)) {
+            if (enable)
+                glEnableVertexAttribArray(i);
+            else
+                glDisableVertexAttribArray(i);
+            state.vertexAttribs[i] = enable;
+        }
+    }
+}
+
+void Renderer::setCapability(GLenum capability, bool& current, bool enable)
+{
+    if (isStateDirty(current != enable)) {
+        if (enable)
+            glEnable(capability);
+        else
+            glDisable(capability);
+        current = enable;
+    }
 }
 
 MeshID Renderer::addMesh(const std::string& filename)
@@ -303,33 +665,102 @@ MeshID Renderer::addMesh(const std::string& filename)
     int ipos = 2*sizeof(int)+numVertices*sizeof(Vertex);
 
     glGenBuffers(1, &mesh->vbid);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbid);
+    bindBuffer(GL_ARRAY_BUFFER, mesh->vbid);
     glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), &buffer[vpos], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     glGenBuffers(1, &mesh->ibid);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
+    bindVertexArray(0);
+    bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(Index), &buffer[ipos], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // Layout is specified once, drawing then only binds the VAO
+    mesh->vao = 0;
+    if (caps.vertexArrays) {
+        glGenVertexArrays(1, &mesh->vao);
+        bindVertexArray(mesh->vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        specifyMeshAttribs(mesh);
+        bindVertexArray(0);
+    }
 
     meshes.push_back(mesh);
     return meshes.size()-1;
 }
 
+void Renderer::specifyMeshAttribs(const Mesh* mesh)
+{
+    bindBuffer(GL_ARRAY_BUFFER, mesh->vbid);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(0));
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(3*sizeof(float)));
+}
+
+void Renderer::specifyQuadAttribs()
+{
+    bindBuffer(GL_ARRAY_BUFFER, quadVB);
+    glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 1*sizeof(float), reinterpret_cast<GLvoid*>(0));
+}
+
 void Renderer::drawMesh(MeshID id)
 {
     assert(id >= 0 && id < meshes.size());
 
     Mesh* mesh = meshes[id];
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
-    glBindBuffer(GL_ARRAY_BUFFER,         mesh->vbid);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(0));
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(3*sizeof(float)));
+    if (caps.vertexArrays) {
+        bindVertexArray(mesh->vao);
+    }
+    else {
+        bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
+        enableVertexAttribs(2);
+        specifyMeshAttribs(mesh);
+    }
     glDrawElements(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_INT, 0);
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
+}
+
+void Renderer::specifyInstanceAttribs(const InstanceBuffer* instances)
+{
+    bindBuffer(GL_ARRAY_BUFFER, instances->id);
+    const int numAttribs = sizeof(Instance) / sizeof(glm::vec4);
+    for (int i = 0; i < numAttribs; i++) {
+        glVertexAttribPointer(2+i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                              reinterpret_cast<GLvoid*>(i*sizeof(glm::vec4)));
+        glVertexAttribDivisor(2+i, 1);
+    }
+}
+
+void Renderer::drawMeshInstanced(MeshID id, InstanceBufferID instancesId, int count)
+{
+    assert(caps.instancing);
+    assert(id >= 0 && id < meshes.size());
+    assert(instancesId >= 0 && instancesId < instanceBuffers.size());
+
+    Mesh* mesh = meshes[id];
+    InstanceBuffer* instances = instanceBuffers[instancesId];
+    assert(count <= instances->count);
+    const int numAttribs = 2 + sizeof(Instance) / sizeof(glm::vec4);
+    if (caps.vertexArrays) {
+        // One VAO per mesh and instance buffer pair, built on first use
+        GLuint& vao = instancedVAOs[std::make_pair(id, instancesId)];
+        if (vao == 0) {
+            glGenVertexArrays(1, &vao);
+            bindVertexArray(vao);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
+            for (int i = 0; i < numAttribs; i++) {
+                glEnableVertexAttribArray(i);
+            }
+            specifyMeshAttribs(mesh);
+            specifyInstanceAttribs(instances);
+        }
+        bindVertexArray(vao);
+    }
+    else {
+        bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibid);
+        enableVertexAttribs(numAttribs);
+        specifyMeshAttribs(mesh);
+        specifyInstanceAttribs(instances);
+    }
+    glDrawElementsInstanced(GL_TRIANGLES, mesh->numIndices, GL_UNSIGNED_INT, 0, count);
 }
 
 void Renderer::drawScreenQuad()
@@ -342,16 +773,22 @@ void Renderer::drawScreenQuad()
     };
 
     setUniform2fv("uv", 4, uv);
-    glBindBuffer(GL_ARRAY_BUFFER, quadVB);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 1*sizeof(float), reinterpret_cast<GLvoid*>(0));
+    if (caps.vertexArrays) {
+        bindVertexArray(quadVAO);
+    }
+    else {
+        enableVertexAttribs(1);
+        specifyQuadAttribs();
+    }
     glDrawArrays(GL_TRIANGLES, 0, 6);
-    glDisableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 TextureID Renderer::addEmptyTexture(int width, int height, PixelFormat format, PixelType type)
+{
+    return addTextureFromData(width, height, format, type, nullptr);
+}
+
+TextureID Renderer::addTextureFromData(int width, int height, PixelFormat format, PixelType type, const void* data)
 {
     int numChannels = 1;
     GLenum glFormat;
@@ -379,17 +816,24 @@ TextureID Renderer::addEmptyTexture(int width, int height, PixelFormat format, P
         assert(false);
 
     Texture* tex = new Texture;
+    tex->isCubemap = false;
+    tex->width = width;
+    tex->height = height;
     glGenTextures(1, &tex->id);
-    glBindTexture(GL_TEXTURE_2D, tex->id);
+    bindTexture(state.activeTextureUnit, GL_TEXTURE_2D, tex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Rows aren't padded
 #ifdef EMSCRIPTEN
-    glTexImage2D(GL_TEXTURE_2D, 0, glFormat, width, height, 0, glFormat, glType, nullptr);
+    glTexImage2D(GL_TEXTURE_2D, 0, glFormat, width, height, 0, glFormat, glType, data);
 #else
     GLenum glInternal = glFormat;
     //assert(type == PixelType::Float and format == PixelFormat::Rgb);
     if (type == PixelType::Float and format == PixelFormat::Rgb)
         glInternal = GL_RGB32F;
-    glTexImage2D(GL_TEXTURE_2D, 0, glInternal, width, height, 0, glFormat, glType, nullptr);
+    if (type == PixelType::Float and format == PixelFormat::Rgba)
+        glInternal = GL_RGBA32F;
+    glTexImage2D(GL_TEXTURE_2D, 0, glInternal, width, height, 0, glFormat, glType, data);
 #endif
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -447,7 +891,7 @@ TextureID Renderer::addTexture(const std::string& filename, PixelFormat internal
     tex->width = width;
     tex->height = height;
     glGenTextures(1, &tex->id);
-    glBindTexture(GL_TEXTURE_2D, tex->id);
+    bindTexture(state.activeTextureUnit, GL_TEXTURE_2D, tex->id);
     glTexImage2D(GL_TEXTURE_2D, 0, glInternal, width, height, 0, glInput, glType, data);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -458,10 +902,62 @@ TextureID Renderer::addTexture(const std::string& filename, PixelFormat internal
     return textures.size()-1;
 }
 
+TextureID Renderer::addMipmappedTexture(const std::string& filename, const std::vector<TextureRect>& levels)
+{
+    std::cout << "Uploading texture: " << filename << std::endl;
+    assert(!levels.empty());
+
+    int width, height, n;
+    u8* data = stbi_load(filename.c_str(), &width, &height, &n, 4);
+    if (data == nullptr) {
+        std::cout << stbi_failure_reason() << std::endl;
+        assert(false);
+    }
+
+    Texture* tex = new Texture;
+    tex->isCubemap = false;
+    tex->width = levels[0].width;
+    tex->height = levels[0].height;
+    glGenTextures(1, &tex->id);
+    bindTexture(state.activeTextureUnit, GL_TEXTURE_2D, tex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    std::vector<u8> level;
+    int levelWidth = 0, levelHeight = 0;
+    for (int i = 0; levelWidth != 1 or levelHeight != 1; i++) {
+        if (i < static_cast<int>(levels.size())) {
+            const TextureRect& rect = levels[i];
+            assert(rect.x >= 0 and rect.y >= 0 and rect.x + rect.width <= width and rect.y + rect.height <= height);
+            assert(i == 0 or (rect.width == std::max(levelWidth/2, 1) and rect.height == std::max(levelHeight/2, 1)));
+            levelWidth = rect.width;
+            levelHeight = rect.height;
+            level.resize(levelWidth * levelHeight * 4);
+            for (int y = 0; y < levelHeight; y++) {
+                const u8* row = data + ((rect.y + y) * width + rect.x) * 4;
+                std::copy(row, row + levelWidth * 4, &level[y * levelWidth * 4]);
+            }
+        }
+        else
+            level = downsampleTexels(level, levelWidth, levelHeight, 4);
+        glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, levelWidth, levelHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, &level[0]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    stbi_image_free(data);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    CGLE;
+    textures.push_back(tex);
+    return textures.size()-1;
+}
+
 TextureID Renderer::addCubemap(const std::string& basefile, PixelFormat internal, PixelFormat input, PixelType type)
 {
-    //std::cout << "Uploading texture: " << filename << std::endl;
+    std::cout << "Uploading cubemap: " << basefile << std::endl;
     assert(internal == input);
+    assert(type == PixelType::Ubyte); // stb_image decodes to 8 bits
 
     int numChannels = 1;
     GLenum glInternal;
@@ -483,54 +979,222 @@ TextureID Renderer::addCubemap(const std::string& basefile, PixelFormat internal
 
     glInput = glInternal;
 
-    GLenum glType;
-    if (type == PixelType::Float)
-        glType = GL_FLOAT;
-    else if (type == PixelType::Ubyte)
-        glType = GL_UNSIGNED_BYTE;
-    else
-        assert(false);
+    // 6 mip levels of 6 faces each, <basefile>_m0<mip>_c0<face>.png
+    const int numMips = 6;
+    struct Image {
+        std::string filename;
+        int width, height;
+        u8* data;
+    };
+    std::vector<Image> images;
+    for (int m = 0; m < numMips; m++) {
+        for (int f = 0; f < 6; f++)
+            images.push_back(Image{basefile + "_m0" + std::to_string(m) + "_c0" + std::to_string(f) + ".png", 0, 0, nullptr});
+    }
+
+    // Decoding takes most of the time and the files are independent, only
+    // the upload needs the context
+    const int numImages = images.size();
+    auto decode = [&](int i) {
+        int n;
+        images[i].data = stbi_load(images[i].filename.c_str(), &images[i].width, &images[i].height, &n, numChannels);
+    };
+#ifdef EMSCRIPTEN
+    for (int i = 0; i < numImages; i++)
+        decode(i);
+#else
+    const int numThreads = std::min(std::max(static_cast<int>(std::thread::hardware_concurrency()), 1), numImages);
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i = next.fetch_add(1); i < numImages; i = next.fetch_add(1))
+            decode(i);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (std::thread& thread: threads)
+        thread.join();
+#endif
+    for (const Image& image: images) {
+        if (image.data == nullptr) {
+            // The reason is shared by all threads, it may be another file's
+            std::cout << image.filename << ": " << stbi_failure_reason() << std::endl;
+            assert(false);
+        }
+    }
 
     Texture* tex = new Texture;
     tex->isCubemap = true;
-    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    tex->width = images[0].width;
+    tex->height = images[0].height;
+#ifndef EMSCRIPTEN
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS); // WebGL has no switch for it
+#endif
     glGenTextures(1, &tex->id);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, tex->id);
-
-    // Go through mip levels and faces for each mip
-    for (int m = 0; m < 6; m++) {
-        for (int f = 0; f < 6; f++) {
-            std::string filename = basefile + "_m0" + std::to_string(m) +
-                                              "_c0" + std::to_string(f) + ".png";
-            std::cout << "Uploading texture: " << filename << std::endl;
-            int width, height, n;
-            u8* data = nullptr;
-            data = stbi_load(filename.c_str(), &width, &height, &n, numChannels);
-            if (data == nullptr) {
-                std::cout << stbi_failure_reason() << std::endl;
-                assert(false);
-            }
-            assert(n == numChannels);
-            std::cout << width << " " << height << std::endl;
-
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, m, glInternal, width, height, 0, glInput, glType, data);
-            stbi_image_free(data);
+    bindTexture(state.activeTextureUnit, GL_TEXTURE_CUBE_MAP, tex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    for (int f = 0; f < 6; f++) {
+        for (int m = 0; m < numMips; m++) {
+            const Image& image = images[m*6 + f];
+            assert(image.width == image.height);
+            assert(image.width == std::max(tex->width >> m, 1));
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, m, glInternal, image.width, image.height, 0,
+                         glInput, GL_UNSIGNED_BYTE, image.data);
+        }
+        // Box filter the rest of the chain down to 1x1 (WebGL 1.0 has no
+        // GL_TEXTURE_MAX_LEVEL), glGenerateMipmap would replace the files' levels
+        const Image& last = images[(numMips-1)*6 + f];
+        int width = last.width, height = last.height;
+        std::vector<u8> level(last.data, last.data + width * height * numChannels);
+        for (int m = numMips; width > 1; m++) {
+            level = downsampleTexels(level, width, height, numChannels);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, m, glInternal, width, height, 0,
+                         glInput, GL_UNSIGNED_BYTE, &level[0]);
         }
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (Image& image: images)
+        stbi_image_free(image.data);
 
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    //glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, 5);
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
 
     CGLE;
     textures.push_back(tex);
     return textures.size()-1;
 }
 
+UniformBufferID Renderer::addUniformBuffer(const std::string& blockName, int size)
+{
+    assert(caps.uniformBuffers);
+    assert(size > 0);
+
+    UniformBuffer* buffer = new UniformBuffer;
+    buffer->binding = uniformBuffers.size();
+    buffer->blockName = blockName;
+    glGenBuffers(1, &buffer->id);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer->id);
+    glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, buffer->binding, buffer->id);
+    uniformBuffers.push_back(buffer);
+
+    for (Shader* shader: shaders) {
+        bindUniformBlocks(shader);
+    }
+    CGLE;
+    return uniformBuffers.size()-1;
+}
+
+void Renderer::updateUniformBuffer(UniformBufferID id, const void* data, int size)
+{
+    assert(id >= 0 && id < uniformBuffers.size());
+    UniformBuffer* buffer = uniformBuffers[id];
+    if (buffer->contents.size() == size && std::memcmp(&buffer->contents[0], data, size) == 0) {
+        stats.bufferUploadsElided++;
+        return;
+    }
+
+    buffer->contents.assign(static_cast<const char*>(data), size);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer->id);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    stats.bufferUploads++;
+}
+
+InstanceBufferID Renderer::addInstanceBuffer()
+{
+    assert(caps.instancing);
+    InstanceBuffer* buffer = new InstanceBuffer;
+    buffer->count = 0;
+    glGenBuffers(1, &buffer->id);
+    instanceBuffers.push_back(buffer);
+    return instanceBuffers.size()-1;
+}
+
+void Renderer::updateInstanceBuffer(InstanceBufferID id, const Instance* instances, int count)
+{
+    assert(id >= 0 && id < instanceBuffers.size());
+    InstanceBuffer* buffer = instanceBuffers[id];
+    bindBuffer(GL_ARRAY_BUFFER, buffer->id);
+    glBufferData(GL_ARRAY_BUFFER, count*sizeof(Instance), instances, GL_DYNAMIC_DRAW);
+    buffer->count = count;
+    stats.bufferUploads++;
+}
+
+void Renderer::bindUniformBlocks(Shader* shader)
+{
+    if (!caps.uniformBuffers)
+        return;
+    for (const UniformBuffer* buffer: uniformBuffers) {
+        const GLuint index = glGetUniformBlockIndex(shader->id, buffer->blockName.c_str());
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(shader->id, index, buffer->binding);
+    }
+}
+
+QueryID Renderer::addQuery(QueryType type)
+{
+    assert(type != QueryType::SamplesPassed || caps.occlusionQueries);
+    assert(type != QueryType::TimeElapsed   || caps.timerQueries);
+    Query* query = new Query;
+    glGenQueries(1, &query->id);
+    query->target = (type == QueryType::TimeElapsed) ? GL_TIME_ELAPSED : GL_SAMPLES_PASSED;
+    query->active = false;
+    query->pending = false;
+    query->result = 0;
+    queries.push_back(query);
+    return queries.size()-1;
+}
+
+void Renderer::beginQuery(QueryID id)
+{
+    assert(id >= 0 && id < queries.size());
+    Query* query = queries[id];
+    assert(!query->active);
+    if (query->pending) {
+        GLint available = 0;
+        glGetQueryObjectiv(query->id, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        if (query->target == GL_TIME_ELAPSED) {
+            GLuint64 result = 0;
+            glGetQueryObjectui64v(query->id, GL_QUERY_RESULT, &result);
+            query->result = result;
+        }
+        else {
+            GLuint result = 0;
+            glGetQueryObjectuiv(query->id, GL_QUERY_RESULT, &result);
+            query->result = result;
+        }
+        query->pending = false;
+    }
+    glBeginQuery(query->target, query->id);
+    query->active = true;
+}
+
+void Renderer::endQuery(QueryID id)
+{
+    assert(id >= 0 && id < queries.size());
+    Query* query = queries[id];
+    if (!query->active)
+        return;
+    glEndQuery(query->target);
+    query->active = false;
+    query->pending = true;
+}
+
+u64 Renderer::getQueryResult(QueryID id) const
+{
+    assert(id >= 0 && id < queries.size());
+    return queries[id]->result;
+}
+
 FramebufferID Renderer::addFramebuffer()
 {
     Framebuffer* framebuffer = new Framebuffer;
@@ -580,6 +1244,13 @@ void Renderer::attachRenderbufferToFramebuffer(FramebufferID framebuffer, Render
     CGLE;
 }
 
+void Renderer::readPixels(int x, int y, int width, int height, u8* rgba)
+{
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    CGLE;
+}
+
 void Renderer::setDefaultFramebuffer()
 {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -591,10 +1262,14 @@ void Renderer::setFramebuffer(FramebufferID framebuffer)
     glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[framebuffer]->id);
 }
 
+void Renderer::beginFrame()
+{
+    stats = RendererStats();
+}
+
 void Renderer::liveReloadUpdate()
 {
 #ifndef EMSCRIPTEN
-    dontAddToTrackedFiles = true;
     for (auto it = trackedShaderFiles.begin(); it != trackedShaderFiles.end(); ++it) {
         const ShaderID id        = it->first;
         ShaderTrackingInfo& info = it->second;
@@ -609,7 +1284,7 @@ void Renderer::liveReloadUpdate()
         if (modTime > info.lastModificationTime) {
             info.lastModificationTime = modTime;
 
-            const ShaderID newId = addShader(info.vsFilenames, info.fsFilenames);
+            const ShaderID newId = loadShader(info.vsFilenames, info.fsFilenames, info.defines);
             if (newId != -1) {
                 Shader* previousVersion = shaders[id];
                 delete previousVersion;
@@ -618,6 +1293,5 @@ void Renderer::liveReloadUpdate()
             }
         }
     }
-    dontAddToTrackedFiles = false;
 #endif
 }
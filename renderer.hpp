@@ -5,6 +5,7 @@
 
 #include <GL/glew.h>
 #include <GL/glfw.h>
+#include <glm/glm.hpp>
 #include <string>
 #include <vector>
 #include <map>
@@ -16,6 +17,13 @@ struct Vertex {
 
 typedef u32 Index;
 
+// Per-instance vertex attributes, locations 2-7 (see INSTANCED in mesh.vs)
+struct Instance {
+    glm::mat4 model;
+    glm::vec4 F0Roughness; // xyz F0, w roughness
+    glm::vec4 kd;          // xyz kd, w unused
+};
+
 #define CGLE checkGLError(__FILE__, __LINE__)
 void checkGLError(const char* file, int line);
 
@@ -24,12 +32,36 @@ typedef int ShaderID;
 typedef int MeshID;
 typedef int FramebufferID;
 typedef int RenderbufferID;
+typedef int UniformBufferID;
+typedef int InstanceBufferID;
+typedef int QueryID;
 
 struct Texture;
 struct Shader;
 struct Mesh;
 struct Renderbuffer;
 struct Framebuffer;
+struct UniformBuffer;
+struct InstanceBuffer;
+struct Query;
+
+// Uniform names are resolved once (see Renderer::getUniform), setting a value
+// through a handle is then a plain array lookup. A handle is valid for every
+// shader (location -1 where the uniform is inactive) and survives live reload.
+template <typename T>
+struct UniformHandle {
+    int slot = -1;
+};
+
+enum class DepthFunc {
+    Less,
+    Equal
+};
+
+enum class QueryType {
+    SamplesPassed, // Fragments passing the depth test
+    TimeElapsed    // GPU time in nanoseconds, requires caps.timerQueries
+};
 
 enum class PixelFormat {
     R,
@@ -43,24 +75,88 @@ enum class PixelType {
     Float
 };
 
+// Part of an image file in texels, row 0 is the first row stored
+struct TextureRect {
+    int x, y, width, height;
+};
+
+// Optional features, detected at startup. Each one is also exposed to shaders
+// as a HAS_* define (see Renderer::addShaderFromSource).
+struct RendererCaps {
+    bool uniformBuffers = false; // HAS_UNIFORM_BUFFERS
+    bool vertexArrays = false;
+    bool instancing = false;
+    bool occlusionQueries = false;
+    bool timerQueries = false;
+    bool floatTextures = false; // Sampling PixelType::Float textures (nearest filtering)
+    bool floatTargets = false; // Float color attachments (PixelType::Float)
+    bool integerOps = false;   // HAS_INTEGER_OPS, bitwise ops on ints in shaders
+    bool fragmentHighp = true; // 32-bit floats in fragment shaders
+    bool textureLod = false;   // HAS_TEXTURE_LOD, explicit lod lookups in fragment shaders (TEXTURE_2D_LOD, TEXTURE_CUBE_LOD)
+};
+
+// Counters for the current frame (reset by Renderer::beginFrame)
+struct RendererStats {
+    int uniformUploads = 0;
+    int uniformUploadsElided = 0;
+    int bufferUploads = 0;
+    int bufferUploadsElided = 0;
+    int stateChanges = 0;
+    int stateChangesSkipped = 0;
+};
+
 class Renderer {
 public:
     Renderer(int canvasWidth, int canvasHeight);
     ~Renderer();
 
     TextureID addTexture(const std::string& filename, PixelFormat internal, PixelFormat input, PixelType type);
+    // Level i is cut out of levels[i], each one half the size of the previous one. Trilinear
+    // filtering, wraps around horizontally. The chain is box filtered on down to 1x1
+    // (WebGL 1.0 has no GL_TEXTURE_MAX_LEVEL). Rgba Ubyte only.
+    TextureID addMipmappedTexture(const std::string& filename, const std::vector<TextureRect>& levels);
     TextureID addCubemap(const std::string& basefile, PixelFormat internal, PixelFormat input, PixelType type);
     TextureID addEmptyTexture(int width, int height, PixelFormat format, PixelType type);
-    ShaderID addShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles);
+    // Tightly packed rows, bottom row first
+    TextureID addTextureFromData(int width, int height, PixelFormat format, PixelType type, const void* data);
+    // Defines are injected as "#define <define>" lines (e.g. "NUM_SAMPLES 16"),
+    // each distinct combination of files and defines is compiled only once.
+    ShaderID addShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles,
+                       const std::vector<std::string>& defines = {});
     ShaderID addShaderFromSource(const std::string& vsSource, const std::string& fsSource);
     MeshID addMesh(const std::string& filename);
 
+    // std140 block shared by all shaders declaring a block of the same name.
+    // Requires caps.uniformBuffers.
+    UniformBufferID addUniformBuffer(const std::string& blockName, int size);
+    void updateUniformBuffer(UniformBufferID id, const void* data, int size);
+
+    // Requires caps.instancing
+    InstanceBufferID addInstanceBuffer();
+    void updateInstanceBuffer(InstanceBufferID id, const Instance* instances, int count);
+
     FramebufferID addFramebuffer();
     RenderbufferID addRenderbuffer(int width, int height, PixelFormat format);
     void attachTextureToFramebuffer(FramebufferID framebuffer, TextureID color);
     void attachRenderbufferToFramebuffer(FramebufferID framebuffer, RenderbufferID renderbuffer);
 
     void setShader(ShaderID shader);
+
+    template <typename T>
+    UniformHandle<T> getUniform(const std::string& name)
+    {
+        UniformHandle<T> handle;
+        handle.slot = getUniformSlot(name);
+        return handle;
+    }
+    void setUniform(UniformHandle<int> handle, int value);
+    void setUniform(UniformHandle<float> handle, float value);
+    void setUniform(UniformHandle<glm::vec2> handle, const glm::vec2* values, int count = 1);
+    void setUniform(UniformHandle<glm::vec3> handle, const glm::vec3* values, int count = 1);
+    void setUniform(UniformHandle<glm::vec4> handle, const glm::vec4* values, int count = 1);
+    void setUniform(UniformHandle<glm::mat4> handle, const glm::mat4* values, int count = 1);
+
+    // Convenience (resolves the name on every call)
     void setUniform1i(const std::string& name, int value);
     void setUniform1f(const std::string& name, float value);
     void setUniform2fv(const std::string& name, int count, const float* value);
@@ -72,30 +168,110 @@ public:
     void setDefaultFramebuffer();
     void setViewport(int x, int y, int width, int height);
     void setTexture(int unit, TextureID id);
+    void setDepthTest(bool enable);
+    void setDepthFunc(DepthFunc func);
+    void setDepthWrite(bool enable);
+    void setColorWrite(bool enable);
+    void setCulling(bool enable);
+
+    // Queries never stall: while a result is still in flight, begin/endQuery
+    // are skipped and getQueryResult keeps returning the last one.
+    QueryID addQuery(QueryType type);
+    void beginQuery(QueryID id);
+    void endQuery(QueryID id);
+    u64 getQueryResult(QueryID id) const;
 
     void drawMesh(MeshID id);
+    void drawMeshInstanced(MeshID id, InstanceBufferID instances, int count);
     void drawScreenQuad();
 
+    // Reads RGBA8 from the bound framebuffer, stalls until the GPU catches up
+    void readPixels(int x, int y, int width, int height, u8* rgba);
+
     void liveReloadUpdate();
 
+    const RendererCaps& getCaps() const { return caps; }
+
+    void beginFrame();
+    const RendererStats& getStats() const { return stats; }
+
 private:
     std::vector<Texture*> textures;
     std::vector<Shader*> shaders;
     std::vector<Mesh*> meshes;
     std::vector<Renderbuffer*> renderbuffers;
     std::vector<Framebuffer*> framebuffers;
+    std::vector<UniformBuffer*> uniformBuffers;
+    std::vector<InstanceBuffer*> instanceBuffers;
+    std::vector<Query*> queries;
+    std::map<std::pair<MeshID, InstanceBufferID>, GLuint> instancedVAOs;
+
+    RendererCaps caps;
+    std::string shaderPrologue; // Extensions and HAS_* defines
+
+    void detectCaps();
+
+    // GL state cache, calls are issued only on change
+    void useProgram(GLuint program);
+    void bindVertexArray(GLuint vertexArray);
+    void bindBuffer(GLenum target, GLuint buffer);
+    void bindTexture(int unit, GLenum target, GLuint texture);
+    void enableVertexAttribs(int count); // Enables [0, count), disables the rest
+    void setCapability(GLenum capability, bool& current, bool enable);
+    bool isStateDirty(bool dirty);
+
+    void specifyMeshAttribs(const Mesh* mesh);
+    void specifyQuadAttribs();
+    void specifyInstanceAttribs(const InstanceBuffer* instances);
+    void bindUniformBlocks(Shader* shader);
+
+    int getUniformSlot(const std::string& name);
+    GLint getUniformLocation(int slot) const;
+    bool isUniformDirty(GLint location, int slot, const void* data, size_t size);
+    void resolveUniformLocations(Shader* shader);
+
+    ShaderID loadShader(const std::vector<std::string>& vsFiles, const std::vector<std::string>& fsFiles,
+                        const std::vector<std::string>& defines);
+
+    // Uniform names by handle slot, shared by all shaders
+    std::vector<std::string> uniformNames;
+    std::map<std::string, int> uniformSlots;
+
+    // Permutations, keyed by files and defines
+    std::map<std::string, ShaderID> shaderCache;
 
     // Live reload on change
     struct ShaderTrackingInfo {
         std::vector<std::string> vsFilenames;
         std::vector<std::string> fsFilenames;
+        std::vector<std::string> defines;
         u64 lastModificationTime;
     };
     std::map<ShaderID, ShaderTrackingInfo> trackedShaderFiles;
-    bool dontAddToTrackedFiles = false;
 
-    ShaderID currentShader;
+    static const int MaxTextureUnits = 8;
+    static const int MaxVertexAttribs = 8;
+    struct {
+        GLuint program = 0;
+        GLuint vertexArray = 0; // Element buffer and attributes below are for 0 only
+        GLuint arrayBuffer = 0;
+        GLuint elementBuffer = 0;
+        int activeTextureUnit = 0;
+        GLuint textures2D[MaxTextureUnits] = {};
+        GLuint texturesCube[MaxTextureUnits] = {};
+        bool vertexAttribs[MaxVertexAttribs] = {};
+        bool depthTest = false;
+        DepthFunc depthFunc = DepthFunc::Less;
+        bool depthWrite = true;
+        bool colorWrite = true;
+        bool culling = false;
+        int viewport[4] = {-1, -1, -1, -1};
+    } state;
+
+    ShaderID currentShader = -1;
+    RendererStats stats;
     GLuint quadVB;
+    GLuint quadVAO = 0;
 };
 
 #endif
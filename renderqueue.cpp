@@ -0,0 +1,215 @@
+#include "renderqueue.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// Sort key layout, most significant first:
+// pass (4 bits) | shader (12) | texture (12) | depth (24) | sequence (12)
+static u64 makeSortKey(RenderPass pass, ShaderID shader, TextureID texture, float depth, int sequence)
+{
+    assert(shader >= 0 && shader < (1 << 12));
+    assert(texture >= -1 && texture < (1 << 12)-1);
+    const u64 quantizedDepth = static_cast<u64>(glm::clamp(depth, 0.f, 1.f) * ((1 << 24)-1));
+    return (static_cast<u64>(pass)        << 60) |
+           (static_cast<u64>(shader)      << 48) |
+           (static_cast<u64>(texture + 1) << 36) |
+           (quantizedDepth                << 12) |
+           (static_cast<u64>(sequence) & 0xfff);
+}
+
+void RenderQueue::clear()
+{
+    packets.clear();
+    uniforms.clear();
+    uniformData.clear();
+}
+
+void RenderQueue::addDraw(RenderPass pass, ShaderID shader, MeshID mesh, float depth, const RasterState& raster)
+{
+    DrawPacket packet;
+    // Texture is patched in by setTexture
+    packet.key = makeSortKey(pass, shader, -1, depth, packets.size());
+    packet.shader = shader;
+    packet.mesh = mesh;
+    packet.instances = -1;
+    packet.numInstances = 0;
+    std::fill(packet.textures, packet.textures + MaxTextures, -1);
+    packet.raster = raster;
+    packet.firstUniform = uniforms.size();
+    packet.numUniforms = 0;
+    packets.push_back(packet);
+}
+
+void RenderQueue::addInstancedDraw(RenderPass pass, ShaderID shader, MeshID mesh, InstanceBufferID instances, int count,
+                                   float depth, const RasterState& raster)
+{
+    addDraw(pass, shader, mesh, depth, raster);
+    packets.back().instances = instances;
+    packets.back().numInstances = count;
+}
+
+void RenderQueue::setTexture(int unit, TextureID texture)
+{
+    assert(!packets.empty());
+    assert(unit >= 0 && unit < MaxTextures);
+    DrawPacket& packet = packets.back();
+    packet.textures[unit] = texture;
+    if (unit == 0) {
+        const u64 textureMask = u64(0xfff) << 36;
+        packet.key = (packet.key & ~textureMask) | (static_cast<u64>(texture + 1) << 36);
+    }
+}
+
+void RenderQueue::addUniform(int slot, UniformType type, int count, const void* data, int size)
+{
+    assert(!packets.empty());
+    assert(size % sizeof(u32) == 0);
+    Uniform uniform;
+    uniform.slot = slot;
+    uniform.type = type;
+    uniform.count = count;
+    uniform.offset = uniformData.size();
+    uniformData.resize(uniformData.size() + size / sizeof(u32));
+    std::memcpy(&uniformData[uniform.offset], data, size);
+    uniforms.push_back(uniform);
+    packets.back().numUniforms++;
+}
+
+void RenderQueue::setUniform(UniformHandle<int> handle, int value)
+{
+    addUniform(handle.slot, UniformType::Int, 1, &value, sizeof(value));
+}
+
+void RenderQueue::setUniform(UniformHandle<float> handle, float value)
+{
+    addUniform(handle.slot, UniformType::Float, 1, &value, sizeof(value));
+}
+
+void RenderQueue::setUniform(UniformHandle<glm::vec2> handle, const glm::vec2* values, int count)
+{
+    addUniform(handle.slot, UniformType::Vec2, count, values, count*sizeof(glm::vec2));
+}
+
+void RenderQueue::setUniform(UniformHandle<glm::vec3> handle, const glm::vec3* values, int count)
+{
+    addUniform(handle.slot, UniformType::Vec3, count, values, count*sizeof(glm::vec3));
+}
+
+void RenderQueue::setUniform(UniformHandle<glm::vec4> handle, const glm::vec4* values, int count)
+{
+    addUniform(handle.slot, UniformType::Vec4, count, values, count*sizeof(glm::vec4));
+}
+
+void RenderQueue::setUniform(UniformHandle<glm::mat4> handle, const glm::mat4* values, int count)
+{
+    addUniform(handle.slot, UniformType::Mat4, count, values, count*sizeof(glm::mat4));
+}
+
+void RenderQueue::setPassQuery(RenderPass pass, QueryType type, QueryID query)
+{
+    passQueries[static_cast<int>(pass)][static_cast<int>(type)] = query;
+}
+
+void RenderQueue::submit()
+{
+    order.resize(packets.size());
+    for (int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return packets[a].key < packets[b].key;
+    });
+
+    // Redundant program, texture and state changes are filtered by the renderer
+    int currentPass = -1;
+    for (int index: order) {
+        const DrawPacket& packet = packets[index];
+        const int pass = packet.key >> 60;
+        if (pass != currentPass) {
+            endPassQueries(currentPass);
+            beginPassQueries(pass);
+            currentPass = pass;
+        }
+
+        renderer->setShader(packet.shader);
+        renderer->setDepthTest(packet.raster.depthTest);
+        renderer->setDepthFunc(packet.raster.depthFunc);
+        renderer->setDepthWrite(packet.raster.depthWrite);
+        renderer->setColorWrite(packet.raster.colorWrite);
+        renderer->setCulling(packet.raster.culling);
+        for (int unit = 0; unit < MaxTextures; unit++) {
+            if (packet.textures[unit] != -1)
+                renderer->setTexture(unit, packet.textures[unit]);
+        }
+
+        for (int i = packet.firstUniform; i < packet.firstUniform + packet.numUniforms; i++) {
+            const Uniform& uniform = uniforms[i];
+            const void* data = &uniformData[uniform.offset];
+            switch (uniform.type) {
+                case UniformType::Int: {
+                    UniformHandle<int> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, *static_cast<const int*>(data));
+                    break;
+                }
+                case UniformType::Float: {
+                    UniformHandle<float> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, *static_cast<const float*>(data));
+                    break;
+                }
+                case UniformType::Vec2: {
+                    UniformHandle<glm::vec2> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, static_cast<const glm::vec2*>(data), uniform.count);
+                    break;
+                }
+                case UniformType::Vec3: {
+                    UniformHandle<glm::vec3> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, static_cast<const glm::vec3*>(data), uniform.count);
+                    break;
+                }
+                case UniformType::Vec4: {
+                    UniformHandle<glm::vec4> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, static_cast<const glm::vec4*>(data), uniform.count);
+                    break;
+                }
+                case UniformType::Mat4: {
+                    UniformHandle<glm::mat4> handle;
+                    handle.slot = uniform.slot;
+                    renderer->setUniform(handle, static_cast<const glm::mat4*>(data), uniform.count);
+                    break;
+                }
+            }
+        }
+
+        if (packet.instances != -1)
+            renderer->drawMeshInstanced(packet.mesh, packet.instances, packet.numInstances);
+        else
+            renderer->drawMesh(packet.mesh);
+    }
+    endPassQueries(currentPass);
+}
+
+void RenderQueue::beginPassQueries(int pass)
+{
+    if (pass < 0)
+        return;
+    for (QueryID query: passQueries[pass]) {
+        if (query != -1)
+            renderer->beginQuery(query);
+    }
+}
+
+void RenderQueue::endPassQueries(int pass)
+{
+    if (pass < 0)
+        return;
+    for (QueryID query: passQueries[pass]) {
+        if (query != -1)
+            renderer->endQuery(query);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef __RENDERQUEUE_HPP__
+#define __RENDERQUEUE_HPP__
+
+#include "renderer.hpp"
+
+#include <vector>
+
+// Passes are submitted in this order
+enum class RenderPass {
+    Background   = 0,
+    DepthPrepass = 1,
+    Opaque       = 2,
+    Diagnostics  = 3  // Debug output, usually submitted on its own into another target
+};
+const int NumRenderPasses = 4;
+
+struct RasterState {
+    bool depthTest  = true;
+    DepthFunc depthFunc = DepthFunc::Less;
+    bool depthWrite = true;
+    bool colorWrite = true;
+    bool culling    = true;
+};
+
+// Collects draws for a frame, sorts them by a 64-bit key and submits them in
+// one go. The key orders by pass, then program, then first texture (fewest
+// switches), then depth (front-to-back, cheaper for opaque meshes).
+class RenderQueue {
+public:
+    static const int MaxTextures = 3;
+
+    RenderQueue(Renderer* renderer): renderer(renderer) {}
+
+    void clear();
+
+    // Starts a packet, textures and uniforms set below belong to it.
+    // depth is the normalized view distance in [0, 1].
+    void addDraw(RenderPass pass, ShaderID shader, MeshID mesh, float depth, const RasterState& raster);
+    void addInstancedDraw(RenderPass pass, ShaderID shader, MeshID mesh, InstanceBufferID instances, int count,
+                          float depth, const RasterState& raster);
+    void setTexture(int unit, TextureID texture);
+    void setUniform(UniformHandle<int> handle, int value);
+    void setUniform(UniformHandle<float> handle, float value);
+    void setUniform(UniformHandle<glm::vec2> handle, const glm::vec2* values, int count = 1);
+    void setUniform(UniformHandle<glm::vec3> handle, const glm::vec3* values, int count = 1);
+    void setUniform(UniformHandle<glm::vec4> handle, const glm::vec4* values, int count = 1);
+    void setUniform(UniformHandle<glm::mat4> handle, const glm::mat4* values, int count = 1);
+
+    // Wraps all packets of a pass in the query (-1 for none)
+    void setPassQuery(RenderPass pass, QueryType type, QueryID query);
+
+    void submit();
+
+private:
+    enum class UniformType {
+        Int,
+        Float,
+        Vec2,
+        Vec3,
+        Vec4,
+        Mat4
+    };
+
+    struct Uniform {
+        int slot;
+        UniformType type;
+        int count;
+        int offset; // Into uniformData
+    };
+
+    struct DrawPacket {
+        u64 key;
+        ShaderID shader;
+        MeshID mesh;
+        InstanceBufferID instances; // -1 if not instanced
+        int numInstances;
+        TextureID textures[MaxTextures];
+        RasterState raster;
+        int firstUniform;
+        int numUniforms;
+    };
+
+    void beginPassQueries(int pass);
+    void endPassQueries(int pass);
+    void addUniform(int slot, UniformType type, int count, const void* data, int size);
+
+    Renderer* renderer;
+    QueryID passQueries[NumRenderPasses][2] = {{-1, -1}, {-1, -1}, {-1, -1}, {-1, -1}};
+    std::vector<DrawPacket> packets;
+    std::vector<Uniform> uniforms;
+    std::vector<u32> uniformData; // Raw 32-bit words (float or int)
+    std::vector<int> order;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "sampletables.hpp"
+
+#include <cmath>
+
+using namespace SampleTables;
+
+template <int N, int... Levels>
+static const Sample* getTable(int level, IndexList<Levels...>)
+{
+    static const Sample* const tables[] = {BakedTable<N, Levels>::table.samples...};
+    return tables[level];
+}
+
+int getBakedLevel(int numSamples, float roughness)
+{
+    const float level = roughness * NumRoughnessLevels - 1.f;
+    const int nearest = static_cast<int>(std::floor(level + 0.5f));
+    if (nearest < 0 || nearest >= NumRoughnessLevels || std::fabs(level - nearest) > 1e-3f)
+        return -1;
+    for (int count: Counts) {
+        if (count == numSamples)
+            return nearest;
+    }
+    return -1;
+}
+
+const Sample* getBakedSamples(int numSamples, float roughness)
+{
+    const int level = getBakedLevel(numSamples, roughness);
+    if (level == -1)
+        return nullptr;
+
+    typedef MakeIndexList<NumRoughnessLevels>::Type Levels;
+    switch (numSamples) {
+        case 16: return getTable<16>(level, Levels());
+        case 32: return getTable<32>(level, Levels());
+        case 64: return getTable<64>(level, Levels());
+    }
+    return nullptr;
+}
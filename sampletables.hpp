@@ -0,0 +1,151 @@
+#ifndef __SAMPLETABLES_HPP__
+#define __SAMPLETABLES_HPP__
+
+#include "sampling.hpp"
+
+// Halton/Trowbridge-Reitz sample tables for a few canonical sample counts and
+// roughness levels, evaluated by the compiler (C++11 constexpr, so everything
+// is a single return statement). Same sequence and filtered lods as
+// App::generateSamples, without the lod bias. tools/bakesamples.cpp writes
+// them out as GLSL too (assets/bakedsamples.part, BAKED_SAMPLES in mesh.fs).
+
+namespace SampleTables {
+
+const int NumRoughnessLevels = 8;
+const int NumCounts = 3;
+const int Counts[NumCounts] = {16, 32, 64};
+
+// Level i has roughness (i+1)/8
+constexpr float getRoughness(int level) { return (level + 1) / static_cast<float>(NumRoughnessLevels); }
+
+struct Sample {
+    float x, y, z, lod;
+};
+
+template <int N>
+struct Table {
+    Sample samples[N];
+};
+
+// Compile-time math, double precision
+namespace cx {
+
+constexpr double Pi = 3.14159265358979323846;
+
+constexpr double getRadicalInverse(int n, int base, double invBi)
+{
+    return (n == 0)? 0.0 : (n % base) * invBi + getRadicalInverse(n / base, base, invBi / base);
+}
+
+constexpr double sqrtIteration(double x, double guess, int iterations)
+{
+    return (iterations == 0)? guess : sqrtIteration(x, 0.5 * (guess + x / guess), iterations - 1);
+}
+
+// x in [0, 1]
+constexpr double sqrt(double x)
+{
+    return (x <= 0.0)? 0.0 : sqrtIteration(x, 1.0, 40);
+}
+
+constexpr double sinSeries(double x2, double term, double sum, int k)
+{
+    return (k > 15)? sum : sinSeries(x2, -term * x2 / ((2*k) * (2*k + 1)), sum + term, k + 1);
+}
+
+// sin(2*pi*t) for t in [-0.5, 0.5], folded onto [-0.25, 0.25]
+constexpr double sinTurns(double t)
+{
+    return (t > 0.25)?  sinTurns(0.5 - t) :
+           (t < -0.25)? sinTurns(-0.5 - t) :
+           sinSeries(4.0*Pi*Pi*t*t, 2.0*Pi*t, 0.0, 1);
+}
+
+constexpr double wrapTurns(double t)
+{
+    return (t >= 0.5)? t - 1.0 : t;
+}
+
+// ln(x) = 2*atanh((x-1)/(x+1)), x in [1, 2)
+constexpr double atanhSeries(double y2, double power, double sum, int k)
+{
+    return (k > 30)? sum : atanhSeries(y2, power * y2, sum + power / (2*k + 1), k + 1);
+}
+
+constexpr double log2(double x)
+{
+    return (x >= 2.0)? 1.0 + log2(0.5 * x) :
+           (x < 1.0)?  -1.0 + log2(2.0 * x) :
+           2.0 * atanhSeries(((x-1.0)/(x+1.0)) * ((x-1.0)/(x+1.0)), (x-1.0)/(x+1.0), 0.0, 0) / 0.69314718055994530942;
+}
+
+constexpr double max(double a, double b)
+{
+    return (a > b)? a : b;
+}
+
+} // namespace cx
+
+// See evaluateTrowbridgeReitz, getTrowbridgeReitzPdf and getFilteredLod
+constexpr double getFilteredLod(double cosTheta, double a2, int numSamples)
+{
+    return cx::max(0.5 * cx::log2(1.0 / (numSamples
+        * cx::max(a2 / (cx::Pi * ((cosTheta*cosTheta*(a2-1.0) + 1.0) * (cosTheta*cosTheta*(a2-1.0) + 1.0))) / 4.0, 1e-6)
+        * (2.0*cx::Pi / PanoramaWidth) * (cx::Pi / PanoramaHeight))), 0.0);
+}
+
+constexpr Sample makeSample(double sinTheta, double cosTheta, double phiTurns, double a2, int numSamples)
+{
+    return Sample{static_cast<float>(sinTheta * cx::sinTurns(cx::wrapTurns(cx::wrapTurns(phiTurns) + 0.25))),
+                  static_cast<float>(sinTheta * cx::sinTurns(cx::wrapTurns(phiTurns))),
+                  static_cast<float>(cosTheta),
+                  static_cast<float>(getFilteredLod(cosTheta, cx::max(a2, 1e-6), numSamples))};
+}
+
+// See importanceSampleTrowbridgeReitz
+constexpr Sample makeSample(double e1, double cos2Theta, double a2, int numSamples)
+{
+    return makeSample(cx::sqrt(1.0 - cos2Theta), cx::sqrt(cos2Theta), e1, a2, numSamples);
+}
+
+constexpr Sample makeSample(int index, double roughness, int numSamples)
+{
+    return makeSample(cx::getRadicalInverse(index + 1, 2, 0.5),
+                      (1.0 - cx::getRadicalInverse(index + 1, 3, 1.0/3.0)) /
+                          (1.0 + (roughness*roughness - 1.0) * cx::getRadicalInverse(index + 1, 3, 1.0/3.0)),
+                      roughness*roughness, numSamples);
+}
+
+template <int... Is>
+struct IndexList {};
+
+template <int N, int... Is>
+struct MakeIndexList: MakeIndexList<N-1, N-1, Is...> {};
+
+template <int... Is>
+struct MakeIndexList<0, Is...> {
+    typedef IndexList<Is...> Type;
+};
+
+template <int N, int... Is>
+constexpr Table<N> makeTable(double roughness, IndexList<Is...>)
+{
+    return Table<N>{{makeSample(Is, roughness, N)...}};
+}
+
+template <int N, int Level>
+struct BakedTable {
+    static constexpr Table<N> table = makeTable<N>(getRoughness(Level), typename MakeIndexList<N>::Type());
+};
+
+template <int N, int Level>
+constexpr Table<N> BakedTable<N, Level>::table;
+
+} // namespace SampleTables
+
+// Baked table for the count and roughness, nullptr if there is none
+const SampleTables::Sample* getBakedSamples(int numSamples, float roughness);
+// Roughness level of a baked table (BAKED_LEVEL), -1 if there is none
+int getBakedLevel(int numSamples, float roughness);
+
+#endif
@@ -0,0 +1,127 @@
+#include "sampling.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+using namespace glm;
+
+// Returns a value in [0, 1), inverting digits. See pharr10.
+float getRadicalInverse(int n, int base)
+{
+    assert(n > 0 && base > 1);
+
+    float value = 0.f;
+    float invBase = 1.f / base;
+    float invBi = invBase;
+    while (n > 0) {
+        int r  = n % base;
+        value += r * invBi;
+        invBi *= invBase;
+        n     /= base;
+    }
+
+    return value;
+}
+
+vec3 importanceSampleTrowbridgeReitz(vec2 e12, float roughness)
+{
+    const float a = roughness;
+    const float phi = 2.f*PI*e12.x;
+    const float cosTheta = std::sqrt((1.f - e12.y) / (1.f + (a*a-1.f)*e12.y));
+    const float sinTheta = std::sqrt(1.f - cosTheta*cosTheta);
+
+    return vec3(sinTheta * std::cos(phi),
+                sinTheta * std::sin(phi),
+                cosTheta);
+}
+
+float evaluateTrowbridgeReitz(float cosThetaH, float roughness)
+{
+    // Clamped, otherwise a perfect mirror has an infinite peak
+    const float a2 = std::max(roughness*roughness, 1e-6f);
+    const float d  = cosThetaH*cosThetaH * (a2-1.f) + 1.f;
+    return a2 / (PI * d*d);
+}
+
+float getTrowbridgeReitzPdf(float cosThetaH, float roughness)
+{
+    // pdf(wj) = D(wh) * cos(theta_h) / (4 * dot(wo, wh)). Viewing direction
+    // isn't known on the CPU, so assume wo == wn (as in most prefiltering
+    // schemes), which reduces the pdf to D(wh) / 4.
+    return evaluateTrowbridgeReitz(cosThetaH, roughness) / 4.f;
+}
+
+float getPanoramaTexelSolidAngle()
+{
+    // Solid angle of a mip 0 texel on the equator. Rows closer to the poles
+    // are smaller by sin(theta), the shader accounts for that per sample
+    // (see panoramaLodBias in panorama.part).
+    return (TwoPI / PanoramaWidth) * (PI / PanoramaHeight);
+}
+
+float getFilteredLod(float pdf, int numSamples, float texelSolidAngle)
+{
+    // GPU Gems 3, chapter 20: each sample represents the solid angle
+    // 1/(N*pdf), pick the mip level whose texels cover about as much.
+    assert(numSamples > 0 && texelSolidAngle > 0.f);
+    const float sampleSolidAngle = 1.f / (numSamples * std::max(pdf, 1e-6f));
+    return std::max(0.5f * std::log2(sampleSolidAngle / texelSolidAngle), 0.f);
+}
+
+std::vector<vec4> buildSampleBank(int numColumns, int numRows, float texelSolidAngle)
+{
+    assert(numColumns > 0 && numRows > 1);
+    std::vector<float> e1(numColumns), e2(numColumns);
+    std::vector<float> x(numColumns), y(numColumns), z(numColumns);
+    getHaltonBatch(0, numColumns, &e1[0], &e2[0]);
+
+    std::vector<vec4> bank;
+    bank.reserve(numColumns * numRows);
+    for (int row = 0; row < numRows; row++) {
+        const float roughness = static_cast<float>(row) / (numRows-1);
+        importanceSampleTrowbridgeReitzBatch(&e1[0], &e2[0], numColumns, roughness, &x[0], &y[0], &z[0]);
+        for (int i = 0; i < numColumns; i++) {
+            const float pdf = getTrowbridgeReitzPdf(z[i], roughness);
+            bank.push_back(vec4(x[i], y[i], z[i], 0.5f * std::log2(1.f / (std::max(pdf, 1e-6f) * texelSolidAngle))));
+        }
+    }
+    return bank;
+}
+
+std::vector<vec2> buildDfgLut(int size, int numSamples)
+{
+    assert(size > 0 && numSamples > 0);
+    std::vector<float> e1(numSamples), e2(numSamples);
+    std::vector<float> x(numSamples), y(numSamples), z(numSamples);
+    getHaltonBatch(0, numSamples, &e1[0], &e2[0]);
+
+    // Tangent space, wn = (0, 0, 1). Clamped like in mesh.fs.
+    const float eps = 0.01f;
+    std::vector<vec2> lut;
+    lut.reserve(size * size);
+    for (int row = 0; row < size; row++) {
+        const float roughness = (row + 0.5f) / size;
+        importanceSampleTrowbridgeReitzBatch(&e1[0], &e2[0], numSamples, roughness, &x[0], &y[0], &z[0]);
+        for (int column = 0; column < size; column++) {
+            const float don = (column + 0.5f) / size;
+            const vec3 wo = vec3(std::sqrt(1.f - don*don), 0.f, don);
+            vec2 scaleBias = vec2(0.f);
+            for (int i = 0; i < numSamples; i++) {
+                const vec3 wh = vec3(x[i], y[i], z[i]);
+                const vec3 wj = 2.f*dot(wh, wo)*wh - wo;
+                if (wj.z <= eps)
+                    continue;
+                const float djh = std::max(dot(wj, wh), eps);
+                const float dhn = std::max(wh.z, eps);
+                const float dio = std::max(dot(wj, wo), eps);
+                // L * G * djh / (don * dhn) * F with L = 1, G = 2*din*don / (1 + dio)
+                const float weight = 2.f * wj.z / (1.f + dio) * djh / dhn;
+                const float Fc = std::pow(1.f - djh, 5.f);
+                scaleBias += weight * vec2(1.f - Fc, Fc);
+            }
+            lut.push_back(scaleBias / static_cast<float>(numSamples));
+        }
+    }
+    return lut;
+}
@@ -0,0 +1,36 @@
+#ifndef __SAMPLING_HPP__
+#define __SAMPLING_HPP__
+
+#include "common.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+// Lat-long panorama resolution at mip 0 (see assets/panorama.part).
+const int PanoramaWidth  = 1024;
+const int PanoramaHeight = 512;
+
+float getRadicalInverse(int n, int base);
+glm::vec3 importanceSampleTrowbridgeReitz(glm::vec2 e12, float roughness);
+float evaluateTrowbridgeReitz(float cosThetaH, float roughness);
+float getTrowbridgeReitzPdf(float cosThetaH, float roughness);
+float getPanoramaTexelSolidAngle();
+float getFilteredLod(float pdf, int numSamples, float texelSolidAngle);
+
+// Half-vectors for roughness row/(numRows-1) (rows) and Halton index
+// column+1 (columns), row-major. w is the unclamped lod of a single sample,
+// N samples filter at max(w - 0.5*log2(N), 0) (see SAMPLE_BANK in mesh.fs).
+std::vector<glm::vec4> buildSampleBank(int numColumns, int numRows, float texelSolidAngle);
+
+// Split-sum DFG table, dot(wo, wn) along x and roughness along y (texel
+// centers), row-major. Scale and bias of F0 in the specular integral, with
+// the same sampler and Kelemen-Kalos G as sampleSpecular in mesh.fs.
+std::vector<glm::vec2> buildDfgLut(int size, int numSamples);
+
+// Batches of samples in SoA arrays (see samplingbatch.cpp), SIMD where available.
+// Halton (2, 3) points for indices firstIndex+1 .. firstIndex+count, below 2^24.
+void getHaltonBatch(int firstIndex, int count, float* e1, float* e2);
+void importanceSampleTrowbridgeReitzBatch(const float* e1, const float* e2, int count, float roughness,
+                                          float* x, float* y, float* z);
+
+#endif
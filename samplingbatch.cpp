@@ -0,0 +1,172 @@
+#include "sampling.hpp"
+#include "simd.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+// Batch versions of the sampling functions, written against the lanes in
+// simd.hpp. Leftovers and platforms without them (emscripten) take the
+// scalar functions from sampling.cpp.
+
+namespace {
+
+#ifdef HAS_SIMD_LANES
+
+// Radical inverse in base 3 from one table of all 3^6 = 729 values of six
+// base-3 digits, looked up once per group: three groups of six digits, so
+// indices stay below 729^3 = 3^18 > 2^24, the largest float-exact integer anyway.
+const int Base3TableSize = 729;
+
+struct Base3Table {
+    float values[Base3TableSize];
+
+    Base3Table()
+    {
+        for (int i = 0; i < Base3TableSize; i++) {
+            float value = 0.f;
+            float invBi = 1.f / 3.f;
+            for (int n = i; n > 0; n /= 3) {
+                value += (n % 3) * invBi;
+                invBi /= 3.f;
+            }
+            values[i] = value;
+        }
+    }
+};
+
+const Base3Table base3Table;
+
+typedef Lanes::F F;
+typedef Lanes::I I;
+
+template <int Bits>
+I swapBits(I n, u32 mask)
+{
+    const I m = Lanes::seti(static_cast<int>(mask));
+    return Lanes::ori(Lanes::shr<Bits>(Lanes::andi(n, m)), Lanes::andi(Lanes::shl<Bits>(n), m));
+}
+
+// Base 2: the radical inverse is the index with its bits reversed
+F getRadicalInverse2(I n)
+{
+    n = Lanes::ori(Lanes::shr<16>(n), Lanes::shl<16>(n));
+    n = swapBits<8>(n, 0xff00ff00);
+    n = swapBits<4>(n, 0xf0f0f0f0);
+    n = swapBits<2>(n, 0xcccccccc);
+    n = swapBits<1>(n, 0xaaaaaaaa);
+    // Top 24 bits, converts exactly
+    return Lanes::mul(Lanes::toFloat(Lanes::shr<8>(n)), Lanes::set(1.f / (1 << 24)));
+}
+
+// Splits x (exact integers) into floor(x / 729) and the remainder
+void divide729(F x, F& quotient, F& remainder)
+{
+    const F divisor = Lanes::set(Base3TableSize);
+    quotient = Lanes::truncate(Lanes::mul(x, Lanes::set(1.f / Base3TableSize)));
+    remainder = Lanes::sub(x, Lanes::mul(quotient, divisor));
+    // 1/729 is rounded, the quotient may be one off
+    const F one = Lanes::set(1.f);
+    const F low = Lanes::lessMask(remainder, Lanes::set(0.f), one);
+    const F high = Lanes::greaterEqualMask(remainder, divisor, one);
+    quotient = Lanes::add(Lanes::sub(quotient, low), high);
+    remainder = Lanes::sub(Lanes::add(remainder, Lanes::mul(low, divisor)), Lanes::mul(high, divisor));
+}
+
+F getRadicalInverse3(I n)
+{
+    F q1, r0, q2, r1;
+    divide729(Lanes::toFloat(n), q1, r0);
+    divide729(q1, q2, r1);
+    const F inv = Lanes::set(1.f / Base3TableSize);
+    F value = Lanes::gather(base3Table.values, q2);
+    value = Lanes::add(Lanes::gather(base3Table.values, r1), Lanes::mul(value, inv));
+    value = Lanes::add(Lanes::gather(base3Table.values, r0), Lanes::mul(value, inv));
+    return value;
+}
+
+// sin(2*pi*t) for t in [-0.5, 0.5]
+F sinTurns(F t)
+{
+    // Fold onto [-0.25, 0.25], sin(pi - x) = sin(x)
+    const F half = Lanes::set(0.5f);
+    const F quarter = Lanes::set(0.25f);
+    const F above = Lanes::greaterEqualMask(t, quarter, Lanes::set(1.f));
+    const F below = Lanes::lessMask(t, Lanes::set(-0.25f), Lanes::set(1.f));
+    // t' = t + above*(0.5 - 2t) + below*(-0.5 - 2t)
+    const F twoT = Lanes::add(t, t);
+    t = Lanes::add(t, Lanes::mul(above, Lanes::sub(half, twoT)));
+    t = Lanes::sub(t, Lanes::mul(below, Lanes::add(half, twoT)));
+
+    // Taylor series up to x^13 on [-pi/2, pi/2], error below 1e-8
+    const F x = Lanes::mul(t, Lanes::set(TwoPI));
+    const F x2 = Lanes::mul(x, x);
+    F p = Lanes::set(1.f / 6227020800.f);
+    p = Lanes::sub(Lanes::set(1.f / 39916800.f), Lanes::mul(x2, p));
+    p = Lanes::sub(Lanes::set(1.f / 362880.f), Lanes::mul(x2, p));
+    p = Lanes::sub(Lanes::set(1.f / 5040.f), Lanes::mul(x2, p));
+    p = Lanes::sub(Lanes::set(1.f / 120.f), Lanes::mul(x2, p));
+    p = Lanes::sub(Lanes::set(1.f / 6.f), Lanes::mul(x2, p));
+    p = Lanes::sub(Lanes::set(1.f), Lanes::mul(x2, p));
+    return Lanes::mul(x, p);
+}
+
+// Wraps t in [-0.5, 1) into [-0.5, 0.5)
+F wrapTurns(F t)
+{
+    return Lanes::sub(t, Lanes::greaterEqualMask(t, Lanes::set(0.5f), Lanes::set(1.f)));
+}
+
+#endif
+
+} // namespace
+
+void getHaltonBatch(int firstIndex, int count, float* e1, float* e2)
+{
+    assert(firstIndex >= 0 && count >= 0);
+    assert(firstIndex + count < (1 << 24));
+    int i = 0;
+#ifdef HAS_SIMD_LANES
+    for (; i + Lanes::Width <= count; i += Lanes::Width) {
+        const I n = Lanes::ramp(firstIndex + i + 1);
+        Lanes::store(e1 + i, getRadicalInverse2(n));
+        Lanes::store(e2 + i, getRadicalInverse3(n));
+    }
+#endif
+    for (; i < count; i++) {
+        e1[i] = getRadicalInverse(firstIndex + i + 1, 2);
+        e2[i] = getRadicalInverse(firstIndex + i + 1, 3);
+    }
+}
+
+void importanceSampleTrowbridgeReitzBatch(const float* e1, const float* e2, int count, float roughness,
+                                          float* x, float* y, float* z)
+{
+    assert(count >= 0);
+    int i = 0;
+#ifdef HAS_SIMD_LANES
+    const F one = Lanes::set(1.f);
+    const F a2Minus1 = Lanes::set(roughness*roughness - 1.f);
+    for (; i + Lanes::Width <= count; i += Lanes::Width) {
+        // See importanceSampleTrowbridgeReitz
+        const F u = Lanes::load(e1 + i);
+        const F v = Lanes::load(e2 + i);
+        const F cos2Theta = Lanes::div(Lanes::sub(one, v), Lanes::add(one, Lanes::mul(a2Minus1, v)));
+        const F cosTheta = Lanes::sqrt(cos2Theta);
+        const F sinTheta = Lanes::sqrt(Lanes::max(Lanes::sub(one, cos2Theta), Lanes::set(0.f)));
+        // phi = 2*pi*u, u in [0, 1)
+        const F t = wrapTurns(u);
+        const F sinPhi = sinTurns(t);
+        const F cosPhi = sinTurns(wrapTurns(Lanes::add(t, Lanes::set(0.25f))));
+        Lanes::store(x + i, Lanes::mul(sinTheta, cosPhi));
+        Lanes::store(y + i, Lanes::mul(sinTheta, sinPhi));
+        Lanes::store(z + i, cosTheta);
+    }
+#endif
+    for (; i < count; i++) {
+        const glm::vec3 wh = importanceSampleTrowbridgeReitz(glm::vec2(e1[i], e2[i]), roughness);
+        x[i] = wh.x;
+        y[i] = wh.y;
+        z[i] = wh.z;
+    }
+}
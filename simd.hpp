@@ -0,0 +1,99 @@
+#ifndef __SIMD_HPP__
+#define __SIMD_HPP__
+
+// A few lane operations over SSE2 (4 wide) or AVX2 (8 wide, when compiled
+// with -mavx2), so kernels are written once (see samplingbatch.cpp and
+// tools/prefilter.cpp). HAS_SIMD_LANES is defined where either is
+// available, i.e. not in emscripten.
+//
+// glm's fvec4SIMD (glm/gtx/simd_vec4.hpp) covers float arithmetic only, the
+// radical inverse needs integer lanes and GGX inversion a vectorised sincos,
+// so the lanes wrap the intrinsics directly.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define HAS_SIMD_LANES 1
+
+#if defined(__AVX2__)
+struct Lanes {
+    typedef __m256  F;
+    typedef __m256i I;
+    static const int Width = 8;
+
+    static F set(float x) { return _mm256_set1_ps(x); }
+    static I seti(int x) { return _mm256_set1_epi32(x); }
+    static I ramp(int first) { return _mm256_setr_epi32(first, first+1, first+2, first+3, first+4, first+5, first+6, first+7); }
+    static F load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, F x) { _mm256_storeu_ps(p, x); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F max(F a, F b) { return _mm256_max_ps(a, b); }
+    static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+    static F truncate(F a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+    // Masked constant, mask lanes are all ones or zeros
+    static F lessMask(F a, F b, F value) { return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), value); }
+    static F greaterEqualMask(F a, F b, F value) { return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ), value); }
+    static F toFloat(I a) { return _mm256_cvtepi32_ps(a); }
+    static I andi(I a, I b) { return _mm256_and_si256(a, b); }
+    static I ori(I a, I b) { return _mm256_or_si256(a, b); }
+    template <int Bits> static I shl(I a) { return _mm256_slli_epi32(a, Bits); }
+    template <int Bits> static I shr(I a) { return _mm256_srli_epi32(a, Bits); }
+    // Exact small integers in x
+    static F gather(const float* table, F x) { return _mm256_i32gather_ps(table, _mm256_cvttps_epi32(x), 4); }
+    static float sum(F a)
+    {
+        alignas(32) float values[Width];
+        _mm256_store_ps(values, a);
+        return ((values[0] + values[1]) + (values[2] + values[3])) + ((values[4] + values[5]) + (values[6] + values[7]));
+    }
+};
+#else
+struct Lanes {
+    typedef __m128  F;
+    typedef __m128i I;
+    static const int Width = 4;
+
+    static F set(float x) { return _mm_set1_ps(x); }
+    static I seti(int x) { return _mm_set1_epi32(x); }
+    static I ramp(int first) { return _mm_setr_epi32(first, first+1, first+2, first+3); }
+    static F load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, F x) { _mm_storeu_ps(p, x); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F max(F a, F b) { return _mm_max_ps(a, b); }
+    static F sqrt(F a) { return _mm_sqrt_ps(a); }
+    static F truncate(F a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); } // |a| < 2^31
+    static F lessMask(F a, F b, F value) { return _mm_and_ps(_mm_cmplt_ps(a, b), value); }
+    static F greaterEqualMask(F a, F b, F value) { return _mm_and_ps(_mm_cmpge_ps(a, b), value); }
+    static F toFloat(I a) { return _mm_cvtepi32_ps(a); }
+    static I andi(I a, I b) { return _mm_and_si128(a, b); }
+    static I ori(I a, I b) { return _mm_or_si128(a, b); }
+    template <int Bits> static I shl(I a) { return _mm_slli_epi32(a, Bits); }
+    template <int Bits> static I shr(I a) { return _mm_srli_epi32(a, Bits); }
+    // No gather before AVX2
+    static F gather(const float* table, F x)
+    {
+        alignas(16) int indices[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(indices), _mm_cvttps_epi32(x));
+        return _mm_setr_ps(table[indices[0]], table[indices[1]], table[indices[2]], table[indices[3]]);
+    }
+    static float sum(F a)
+    {
+        alignas(16) float values[Width];
+        _mm_store_ps(values, a);
+        return (values[0] + values[1]) + (values[2] + values[3]);
+    }
+};
+#endif
+#endif
+
+#endif
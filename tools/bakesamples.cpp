@@ -0,0 +1,53 @@
+// Writes the compile-time sample tables (sampletables.hpp) as GLSL, so shader
+// permutations can embed them instead of receiving a uniform upload.
+// GLSL ES 1.00 has no array initializers, the table is filled by a function.
+//
+// Usage: bakesamples <output.part>
+
+#include "../sampletables.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <output.part>" << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(argv[1]);
+    if (!out) {
+        std::cout << "Failed to write " << argv[1] << "!" << std::endl;
+        return 1;
+    }
+
+    out << "// Generated by tools/bakesamples.cpp from sampletables.hpp, do not edit.\n"
+        << "// Halton/Trowbridge-Reitz half-vectors for roughness (BAKED_LEVEL+1)/"
+        << SampleTables::NumRoughnessLevels << " and NUM_SAMPLES\n"
+        << "// samples, w is the filtered lod without bias (see BAKED_SAMPLES in mesh.fs).\n"
+        << "vec4 whs[NUM_SAMPLES];\n\n"
+        << "void loadBakedSamples()\n"
+        << "{\n";
+
+    out << std::setprecision(9);
+    const char* directive = "#if";
+    for (int count: SampleTables::Counts) {
+        for (int level = 0; level < SampleTables::NumRoughnessLevels; level++) {
+            const SampleTables::Sample* samples = getBakedSamples(count, SampleTables::getRoughness(level));
+            out << directive << " NUM_SAMPLES == " << count << " && BAKED_LEVEL == " << level << "\n";
+            for (int i = 0; i < count; i++) {
+                const SampleTables::Sample& s = samples[i];
+                out << "    whs[" << i << "] = vec4(" << std::fixed
+                    << s.x << ", " << s.y << ", " << s.z << ", " << s.lod << ");\n";
+            }
+            directive = "#elif";
+        }
+    }
+    out << "#endif\n"
+        << "}\n";
+
+    std::cout << "Wrote sample tables to " << argv[1] << std::endl;
+    return 0;
+}
@@ -0,0 +1,150 @@
+// Tileable blue-noise mask generator (void-and-cluster, Ulichney 1993).
+// Writes a greyscale TGA where every value 0..255 occurs equally often and
+// neighbouring pixels are as different as possible, see BLUE_NOISE in mesh.fs.
+//
+// Usage: bluenoise <size> <output.tga> [seed]
+
+#include "tga.hpp"
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+#include <string>
+
+class VoidAndCluster {
+public:
+    VoidAndCluster(int size, float sigma): size(size), pattern(size*size, false), energy(size*size, 0.f)
+    {
+        // Gaussian weights by toroidal offset, the mask tiles seamlessly
+        kernel.resize(size*size);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                const int dx = std::min(x, size-x);
+                const int dy = std::min(y, size-y);
+                kernel[y*size + x] = std::exp(-(dx*dx + dy*dy) / (2.f*sigma*sigma));
+            }
+        }
+    }
+
+    void set(int i, bool value)
+    {
+        if (pattern[i] == value)
+            return;
+        pattern[i] = value;
+        const int px = i % size;
+        const int py = i / size;
+        const float sign = value ? 1.f : -1.f;
+        for (int y = 0; y < size; y++) {
+            const int ky = (y - py + size) % size;
+            for (int x = 0; x < size; x++) {
+                const int kx = (x - px + size) % size;
+                energy[y*size + x] += sign * kernel[ky*size + kx];
+            }
+        }
+    }
+
+    bool get(int i) const { return pattern[i]; }
+
+    // Set pixel with the most set neighbours
+    int findTightestCluster() const
+    {
+        int best = -1;
+        for (int i = 0; i < size*size; i++) {
+            if (pattern[i] && (best == -1 || energy[i] > energy[best]))
+                best = i;
+        }
+        return best;
+    }
+
+    // Unset pixel furthest from any set one. Past half the pixels this is
+    // also the tightest cluster of unset ones (energies sum to a constant).
+    int findLargestVoid() const
+    {
+        int best = -1;
+        for (int i = 0; i < size*size; i++) {
+            if (!pattern[i] && (best == -1 || energy[i] < energy[best]))
+                best = i;
+        }
+        return best;
+    }
+
+private:
+    int size;
+    std::vector<bool> pattern;
+    std::vector<float> energy;
+    std::vector<float> kernel;
+};
+
+std::vector<int> generateBlueNoiseRanks(int size, unsigned seed)
+{
+    const int numPixels = size*size;
+    const int numInitial = numPixels / 10;
+    VoidAndCluster initial(size, 1.5f);
+
+    // Random initial pattern...
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> pixel(0, numPixels-1);
+    for (int placed = 0; placed < numInitial; ) {
+        const int i = pixel(rng);
+        if (!initial.get(i)) {
+            initial.set(i, true);
+            placed++;
+        }
+    }
+
+    // ...relaxed by moving the tightest cluster into the largest void until stable
+    for (;;) {
+        const int cluster = initial.findTightestCluster();
+        initial.set(cluster, false);
+        const int hole = initial.findLargestVoid();
+        initial.set(hole, true);
+        if (hole == cluster)
+            break;
+    }
+
+    std::vector<int> ranks(numPixels, -1);
+
+    // Phase 1, ranks below the initial count: remove clusters
+    VoidAndCluster pattern = initial;
+    for (int rank = numInitial-1; rank >= 0; rank--) {
+        const int cluster = pattern.findTightestCluster();
+        pattern.set(cluster, false);
+        ranks[cluster] = rank;
+    }
+
+    // Phases 2 and 3: fill voids
+    pattern = initial;
+    for (int rank = numInitial; rank < numPixels; rank++) {
+        const int hole = pattern.findLargestVoid();
+        pattern.set(hole, true);
+        ranks[hole] = rank;
+    }
+    return ranks;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <size> <output.tga> [seed]" << std::endl;
+        return 1;
+    }
+    const int size = std::stoi(argv[1]);
+    const std::string output = argv[2];
+    const unsigned seed = (argc > 3)? std::stoul(argv[3]) : 1;
+    assert(size >= 4 && size <= 256);
+
+    const std::vector<int> ranks = generateBlueNoiseRanks(size, seed);
+    std::vector<u8> pixels(size*size);
+    for (int i = 0; i < size*size; i++) {
+        assert(ranks[i] >= 0);
+        pixels[i] = static_cast<u8>(ranks[i] * 256 / (size*size));
+    }
+
+    if (!writeTga(output, size, size, 1, &pixels[0]))
+        return 1;
+    std::cout << "Wrote " << size << "x" << size << " blue noise to " << output << std::endl;
+    return 0;
+}
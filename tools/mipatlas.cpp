@@ -0,0 +1,187 @@
+// Packs a lat-long HDR panorama into the RGBM mip atlas samplePanorama
+// (assets/panorama.part) decodes, e.g. assets/grace.tga. The atlas is
+// 1024x1024 and level i is (1024 >> i) x (512 >> i). It covers rows
+// (512 >> i) - 2i onwards, so level 0 takes the bottom half, and every
+// level starts at the left edge. Each level has 1px of padding:
+// - rows above and below continue across the pole (the row itself,
+//   shifted by half a turn);
+// - column (1024 >> i) repeats column 0;
+// - atlas column 1023 repeats the level's last column, which is where
+//   GL_REPEAT fetches from for u < 0.
+// Level 0's bottom padding wraps around to atlas row 0.
+//
+// Each level is a 2x decimation of the previous one in linear HDR, a
+// separable Lanczos-3 filter. It wraps around horizontally and reflects
+// across the poles vertically. Rows are spread over all cores, one level
+// after another.
+//
+// Usage: mipatlas <input.hdr> <output.tga>
+// Anything stbi_loadf reads works, 2:1 lat-long with at least 512 rows
+// (a power of two).
+
+#include "tga.hpp"
+#include "rgbm.hpp"
+#include "panorama.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// See samplePanorama
+const int AtlasSize = 1024;
+const int NumLevels = 6;
+// Lanczos-3 at half resolution reaches 6 source texels out
+const int NumTaps = 12;
+
+float sinc(float x)
+{
+    if (std::abs(x) < 1e-6f)
+        return 1.f;
+    return std::sin(PI*x) / (PI*x);
+}
+
+struct Kernel {
+    float weights[NumTaps];
+
+    Kernel()
+    {
+        // Output texel j is centered between source texels 2j and 2j+1,
+        // tap k reads 2j - 5 + k
+        float sum = 0.f;
+        for (int k = 0; k < NumTaps; k++) {
+            const float x = 0.5f * (k - 5.5f); // In output texels
+            weights[k] = (std::abs(x) < 3.f)? sinc(x) * sinc(x / 3.f) : 0.f;
+            sum += weights[k];
+        }
+        for (int k = 0; k < NumTaps; k++)
+            weights[k] /= sum;
+    }
+};
+
+const Kernel kernel;
+
+// Half resolution, horizontal then vertical. Negative lobes ring around
+// bright spots (the sun), results are clamped to 0.
+Image downsample(const Image& image)
+{
+    Image horizontal(image.width / 2, image.height);
+    parallelFor(horizontal.height, [&](int y) {
+        for (int c = 0; c < 3; c++) {
+            const float* in = &image.channel(c)[y*image.width];
+            float* out = &horizontal.channel(c)[y*horizontal.width];
+            for (int x = 0; x < horizontal.width; x++) {
+                for (int k = 0; k < NumTaps; k++) {
+                    const int sourceX = (2*x - 5 + k + image.width) % image.width; // Longitude wraps around
+                    out[x] += kernel.weights[k] * in[sourceX];
+                }
+            }
+        }
+    });
+
+    Image result(horizontal.width, horizontal.height / 2);
+    const int halfTurn = horizontal.width / 2;
+    parallelFor(result.height, [&](int y) {
+        for (int x = 0; x < result.width; x++) {
+            float out[3] = {0.f, 0.f, 0.f};
+            for (int k = 0; k < NumTaps; k++) {
+                // Past a pole, continue down the meridian half a turn away
+                int sourceY = 2*y - 5 + k;
+                int sourceX = x;
+                if (sourceY < 0 or sourceY >= horizontal.height) {
+                    sourceY = (sourceY < 0)? -sourceY - 1 : 2*horizontal.height - sourceY - 1;
+                    sourceX = (x + halfTurn) % horizontal.width;
+                }
+                for (int c = 0; c < 3; c++)
+                    out[c] += kernel.weights[k] * horizontal.channel(c)[sourceY*horizontal.width + sourceX];
+            }
+            for (int c = 0; c < 3; c++)
+                result.channel(c)[y*result.width + x] = std::max(out[c], 0.f);
+        }
+    });
+    return result;
+}
+
+int getLevelFirstRow(int level)
+{
+    // offset in samplePanorama, 0.5/2^i - 2i/1024
+    return (AtlasSize/2 >> level) - 2*level;
+}
+
+// One atlas row from a level row, shifted by whole texels (wrapping around)
+void encodeRow(const Image& level, int levelY, int shift, int atlasY, std::vector<u8>& atlas)
+{
+    for (int x = 0; x < level.width; x++) {
+        const int i = levelY*level.width + (x + shift) % level.width;
+        encodeRgbm(level.r[i], level.g[i], level.b[i], &atlas[(atlasY*AtlasSize + x) * 4]);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <input.hdr> <output.tga>" << std::endl;
+        return 1;
+    }
+
+    Image panorama(0, 0);
+    if (!loadPanorama(argv[1], panorama))
+        return 1;
+    const int width = panorama.width;
+    const int height = panorama.height;
+    if (height < AtlasSize/2 or (height & (height-1)) != 0) {
+        std::cout << "Expected a power of two height, at least " << AtlasSize/2 << "!" << std::endl;
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<Image> levels;
+    levels.push_back(std::move(panorama));
+    // Down to the atlas' level 0 first
+    while (levels.back().width > AtlasSize)
+        levels.back() = downsample(levels.back());
+    while (static_cast<int>(levels.size()) < NumLevels)
+        levels.push_back(downsample(levels.back()));
+
+    // Unused texels decode to 0
+    std::vector<u8> atlas(AtlasSize * AtlasSize * 4, 0);
+    for (int i = 0; i < NumLevels; i++) {
+        const Image& level = levels[i];
+        const int firstRow = getLevelFirstRow(i);
+        parallelFor(level.height, [&](int y) {
+            encodeRow(level, y, 0, firstRow + y, atlas);
+        });
+        // Pole padding, level 0's bottom one wraps around (GL_REPEAT)
+        const int halfTurn = level.width / 2;
+        const int paddingAbove = firstRow - 1;
+        const int paddingBelow = (firstRow + level.height) % AtlasSize;
+        encodeRow(level, 0, halfTurn, paddingAbove, atlas);
+        encodeRow(level, level.height - 1, halfTurn, paddingBelow, atlas);
+
+        // Longitude padding, level 0 spans the whole width and wraps by itself
+        if (i == 0)
+            continue;
+        for (int y = -1; y <= level.height; y++) {
+            const int row = (y == -1)? paddingAbove : (y == level.height)? paddingBelow : firstRow + y;
+            u8* texels = &atlas[row * AtlasSize * 4];
+            std::copy(texels, texels + 4, texels + level.width * 4);
+            std::copy(texels + (level.width - 1) * 4, texels + level.width * 4, texels + (AtlasSize - 1) * 4);
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Packed " << width << "x" << height << " into " << NumLevels << " levels in " << seconds
+              << " s (" << getNumThreads() << " threads)" << std::endl;
+
+    if (!writeTga(argv[2], AtlasSize, AtlasSize, 4, &atlas[0])) {
+        std::cout << "Failed to write " << argv[2] << "!" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Converts a lat-long HDR panorama into the octahedral RGBM atlas
+// sampleOctahedral (assets/octahedral.part) decodes. Level i is
+// (512 >> i)^2, 6 levels. Each level has 1px of padding around it, the
+// square's edges continue mirrored (the texel across an edge is the one
+// mirrored across the edge's midpoint). Level 0 takes the left 514x514,
+// the others are stacked top to bottom to its right, 772x514 in total.
+//
+// Level 0 averages a grid of bilinear panorama lookups per texel, dense
+// enough for the input's resolution. Each next level is a 2x2 box filter of
+// the previous one in linear HDR, texels are close enough to equal area.
+// Rows are spread over all cores.
+//
+// Usage: octahedral <input.hdr> <output.tga>
+// Anything stbi_loadf reads works, 2:1 lat-long.
+
+#include "tga.hpp"
+#include "rgbm.hpp"
+#include "panorama.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// See octahedral.part
+const int LevelSize = 512;
+const int NumLevels = 6;
+const int AtlasWidth = LevelSize + 2 + LevelSize/2 + 2;
+const int AtlasHeight = LevelSize + 2;
+
+// Inverse of getOctahedralUv, u and v in [0, 1]
+void getOctahedralDir(float u, float v, float* dir)
+{
+    float x = 2.f*u - 1.f;
+    float z = 2.f*v - 1.f;
+    const float y = 1.f - std::abs(x) - std::abs(z);
+    if (y < 0.f) {
+        const float foldedX = (1.f - std::abs(z)) * ((x >= 0.f)? 1.f : -1.f);
+        const float foldedZ = (1.f - std::abs(x)) * ((z >= 0.f)? 1.f : -1.f);
+        x = foldedX;
+        z = foldedZ;
+    }
+    const float invLength = 1.f / std::sqrt(x*x + y*y + z*z);
+    dir[0] = x * invLength;
+    dir[1] = y * invLength;
+    dir[2] = z * invLength;
+}
+
+Image convert(const Image& panorama)
+{
+    // Level 0 texels are about two equator texels of a 2048x1024 panorama
+    // wide, a 4x4 grid covers that and larger inputs get a denser one
+    const int gridSize = std::max(4, 4 * panorama.height / 1024);
+    Image level(LevelSize, LevelSize);
+    parallelFor(LevelSize, [&](int y) {
+        for (int x = 0; x < LevelSize; x++) {
+            Color sum = {0.f, 0.f, 0.f};
+            for (int j = 0; j < gridSize; j++) {
+                for (int i = 0; i < gridSize; i++) {
+                    float dir[3];
+                    getOctahedralDir((x + (i + 0.5f) / gridSize) / LevelSize,
+                                     (y + (j + 0.5f) / gridSize) / LevelSize, dir);
+                    const float theta = std::acos(std::max(std::min(dir[1], 1.f), -1.f));
+                    const Color color = samplePanorama(panorama, theta, std::atan2(-dir[0], dir[2]));
+                    sum.r += color.r;
+                    sum.g += color.g;
+                    sum.b += color.b;
+                }
+            }
+            const float norm = 1.f / (gridSize * gridSize);
+            level.r[y*LevelSize + x] = sum.r * norm;
+            level.g[y*LevelSize + x] = sum.g * norm;
+            level.b[y*LevelSize + x] = sum.b * norm;
+        }
+    });
+    return level;
+}
+
+Image downsample(const Image& image)
+{
+    Image result(image.width / 2, image.height / 2);
+    parallelFor(result.height, [&](int y) {
+        for (int c = 0; c < 3; c++) {
+            const float* row0 = &image.channel(c)[2*y*image.width];
+            const float* row1 = row0 + image.width;
+            float* out = &result.channel(c)[y*result.width];
+            for (int x = 0; x < result.width; x++)
+                out[x] = 0.25f * (row0[2*x] + row0[2*x + 1] + row1[2*x] + row1[2*x + 1]);
+        }
+    });
+    return result;
+}
+
+// Index of texel (x, y) of a level, coordinates up to 1px outside it continue mirrored
+int getMirroredIndex(const Image& level, int x, int y)
+{
+    const int size = level.width;
+    if (x < 0 or x >= size) {
+        x = (x < 0)? -x - 1 : 2*size - x - 1;
+        y = size - 1 - y;
+    }
+    if (y < 0 or y >= size) {
+        y = (y < 0)? -y - 1 : 2*size - y - 1;
+        x = size - 1 - x;
+    }
+    return y*size + x;
+}
+
+// See getOctahedralLevel
+void getLevelOrigin(int level, int* x, int* y)
+{
+    const int size = LevelSize >> level;
+    *x = (level == 0)? 1 : LevelSize + 3;
+    *y = (level == 0)? 1 : LevelSize - 1 + 2*level - 2*size;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <input.hdr> <output.tga>" << std::endl;
+        return 1;
+    }
+
+    Image panorama(0, 0);
+    if (!loadPanorama(argv[1], panorama))
+        return 1;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<Image> levels;
+    levels.push_back(convert(panorama));
+    while (static_cast<int>(levels.size()) < NumLevels)
+        levels.push_back(downsample(levels.back()));
+
+    // Unused texels decode to 0
+    std::vector<u8> atlas(AtlasWidth * AtlasHeight * 4, 0);
+    for (int i = 0; i < NumLevels; i++) {
+        const Image& level = levels[i];
+        int originX, originY;
+        getLevelOrigin(i, &originX, &originY);
+        parallelFor(level.height + 2, [&](int row) {
+            const int y = row - 1;
+            for (int x = -1; x <= level.width; x++) {
+                const int i = getMirroredIndex(level, x, y);
+                encodeRgbm(level.r[i], level.g[i], level.b[i], &atlas[((originY + y)*AtlasWidth + originX + x) * 4]);
+            }
+        });
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Converted " << panorama.width << "x" << panorama.height << " into " << NumLevels << " octahedral levels in " << seconds
+              << " s (" << getNumThreads() << " threads)" << std::endl;
+
+    if (!writeTga(argv[2], AtlasWidth, AtlasHeight, 4, &atlas[0])) {
+        std::cout << "Failed to write " << argv[2] << "!" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "panorama.hpp"
+
+#define STBI_HEADER_FILE_ONLY
+#include "../stb_image.cpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <thread>
+
+bool loadPanorama(const std::string& filename, Image& image)
+{
+    int width, height, n;
+    float* data = stbi_loadf(filename.c_str(), &width, &height, &n, 3);
+    if (data == nullptr) {
+        std::cout << "Failed to load " << filename << ": " << stbi_failure_reason() << std::endl;
+        return false;
+    }
+    if (width != 2*height) {
+        std::cout << "Expected a 2:1 lat-long panorama!" << std::endl;
+        stbi_image_free(data);
+        return false;
+    }
+
+    image = Image(width, height);
+    for (int i = 0; i < width*height; i++) {
+        image.r[i] = data[3*i];
+        image.g[i] = data[3*i + 1];
+        image.b[i] = data[3*i + 2];
+    }
+    stbi_image_free(data);
+    return true;
+}
+
+Color samplePanorama(const Image& image, float theta, float phi)
+{
+    const float x = (phi / PI + 1.f) * 0.5f * image.width - 0.5f;
+    const float y = std::min(std::max(theta / PI * image.height - 0.5f, 0.f), image.height - 1.f);
+    const int x0 = static_cast<int>(std::floor(x));
+    const int y0 = static_cast<int>(y);
+    const float fx = x - x0;
+    const float fy = y - y0;
+    const int y1 = std::min(y0 + 1, image.height - 1);
+    const int columns[2] = {(x0 % image.width + image.width) % image.width, ((x0 + 1) % image.width + image.width) % image.width};
+    const float weights[4] = {(1.f-fx)*(1.f-fy), fx*(1.f-fy), (1.f-fx)*fy, fx*fy};
+    const int indices[4] = {y0*image.width + columns[0], y0*image.width + columns[1],
+                            y1*image.width + columns[0], y1*image.width + columns[1]};
+    Color color = {0.f, 0.f, 0.f};
+    for (int i = 0; i < 4; i++) {
+        color.r += weights[i] * image.r[indices[i]];
+        color.g += weights[i] * image.g[indices[i]];
+        color.b += weights[i] * image.b[indices[i]];
+    }
+    return color;
+}
+
+int getNumThreads()
+{
+    return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
+void parallelFor(int count, const std::function<void(int)>& body)
+{
+    const int chunk = 8;
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk)) {
+            for (int i = first; i < std::min(first + chunk, count); i++)
+                body(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < getNumThreads(); i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (std::thread& thread: threads)
+        thread.join();
+}
@@ -0,0 +1,41 @@
+#ifndef __PANORAMA_HPP__
+#define __PANORAMA_HPP__
+
+#include "../common.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Shared by the environment tools (prefilter, mipatlas, octahedral)
+
+// Planar RGB floats, row 0 first. For lat-long panoramas row 0 is at
+// theta = 0 (+y), as in samplePanorama (assets/panorama.part).
+struct Image {
+    int width, height;
+    std::vector<float> r, g, b;
+
+    Image(int width, int height): width(width), height(height),
+        r(width*height), g(width*height), b(width*height) {}
+
+    std::vector<float>& channel(int c) { return (c == 0)? r : (c == 1)? g : b; }
+    const std::vector<float>& channel(int c) const { return (c == 0)? r : (c == 1)? g : b; }
+};
+
+struct Color {
+    float r, g, b;
+};
+
+// Anything stbi_loadf reads, checked to be 2:1 lat-long. Prints why not
+// and returns false on failure.
+bool loadPanorama(const std::string& filename, Image& image);
+
+// Bilinear, wraps around in phi and clamps in theta. phi = atan(-x, z) as
+// in samplePanorama, theta from +y.
+Color samplePanorama(const Image& image, float theta, float phi);
+
+// Indices [0, count) in chunks of 8, on all cores
+void parallelFor(int count, const std::function<void(int)>& body);
+int getNumThreads();
+
+#endif
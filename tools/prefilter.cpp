@@ -0,0 +1,338 @@
+// Prefilters a lat-long environment for the split-sum mode, in the layout
+// of assets/prefiltered.part (levels for roughness 0, 1/7 .. 1 stacked
+// vertically, RGBM). Same lobe as assets/prefilter.fs, Trowbridge-Reitz
+// around wo == wn weighted by the cosine, but as a full convolution over
+// the source instead of a few filtered samples. Each level reads the
+// coarsest source mip that still resolves its lobe, over a window holding
+// most of the lobe's energy.
+//
+// Output tiles are spread over all cores, workers steal from each other
+// once their own queue runs dry (cost varies a lot between levels and
+// towards the poles). The inner loop runs over the simd.hpp lanes.
+//
+// Usage: prefilter <input.hdr> <output.tga>
+// Anything stbi_loadf reads works, 2:1 lat-long (e.g. Radiance .hdr).
+// Load the result with setValue("prefilteredMap", <output.tga>).
+
+#include "../simd.hpp"
+#include "tga.hpp"
+#include "rgbm.hpp"
+#include "panorama.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// See App::PrefilteredLevels, App::PrefilteredWidth and App::PrefilteredLevelHeight
+const int Levels = 8;
+const int LevelWidth = 512;
+const int LevelHeight = 256;
+const int TileSize = 32;
+// Source texels across the lobe's core (half of its energy)
+const float TexelsPerLobe = 8.f;
+// Share of the lobe's energy inside the convolution window
+const float WindowEnergy = 0.99f;
+
+float getTheta(int row, int height)
+{
+    return (row + 0.5f) / height * PI;
+}
+
+// See getLatLongDir in assets/prefiltered.part
+float getPhi(int column, int width)
+{
+    return ((column + 0.5f) / width * 2.f - 1.f) * PI;
+}
+
+// 2x2 box, rows weighted by their solid angle
+Image downsample(const Image& image)
+{
+    Image result(image.width / 2, image.height / 2);
+    for (int y = 0; y < result.height; y++) {
+        const float w0 = std::sin(getTheta(2*y, image.height));
+        const float w1 = std::sin(getTheta(2*y + 1, image.height));
+        const float norm = 1.f / (2.f * (w0 + w1));
+        for (int x = 0; x < result.width; x++) {
+            const int i0 = 2*y * image.width + 2*x;
+            const int i1 = i0 + image.width;
+            const int j = y * result.width + x;
+            result.r[j] = ((image.r[i0] + image.r[i0+1]) * w0 + (image.r[i1] + image.r[i1+1]) * w1) * norm;
+            result.g[j] = ((image.g[i0] + image.g[i0+1]) * w0 + (image.g[i1] + image.g[i1+1]) * w1) * norm;
+            result.b[j] = ((image.b[i0] + image.b[i0+1]) * w0 + (image.b[i1] + image.b[i1+1]) * w1) * norm;
+        }
+    }
+    return result;
+}
+
+// Source mip and window for one level
+struct Level {
+    const Image* source;
+    float a2Minus1;
+    float windowAngle;
+    std::vector<float> cosTheta, sinTheta; // Source rows
+    std::vector<float> cosPhi, sinPhi;     // Source columns
+};
+
+Level setupLevel(const std::vector<Image>& mips, float roughness)
+{
+    // Half of the half-vectors are within atan(roughness) of wn (invert
+    // importanceSampleTrowbridgeReitz at 0.5), the reflections twice that
+    const float a2 = roughness*roughness;
+    const float coreAngle = 2.f * std::atan(roughness);
+    const float neededHeight = TexelsPerLobe * PI / coreAngle;
+    int mip = static_cast<int>(mips.size()) - 1;
+    while (mip > 0 and mips[mip].height < neededHeight)
+        mip--;
+
+    Level level;
+    level.source = &mips[mip];
+    level.a2Minus1 = a2 - 1.f;
+    const float cos2ThetaH = (1.f - WindowEnergy) / (1.f + (a2 - 1.f) * WindowEnergy);
+    level.windowAngle = std::min(2.f * std::acos(std::sqrt(cos2ThetaH)), PI2);
+
+    const Image& source = *level.source;
+    for (int y = 0; y < source.height; y++) {
+        level.cosTheta.push_back(std::cos(getTheta(y, source.height)));
+        level.sinTheta.push_back(std::sin(getTheta(y, source.height)));
+    }
+    for (int x = 0; x < source.width; x++) {
+        level.cosPhi.push_back(std::cos(getPhi(x, source.width)));
+        level.sinPhi.push_back(std::sin(getPhi(x, source.width)));
+    }
+    return level;
+}
+
+struct Sums {
+    float r = 0.f, g = 0.f, b = 0.f, weight = 0.f;
+};
+
+// Kernel weight of a source texel: D(wh) * dot(wl, wn) times its solid
+// angle. With wo == wn, cos^2(theta_h) = (1 + dot(wl, wn)) / 2, constant
+// factors cancel in the normalisation.
+inline float getWeight(float dot, float a2Minus1, float rowWeight)
+{
+    const float q = (1.f + dot) * 0.5f * a2Minus1 + 1.f;
+    return std::max(dot, 0.f) / (q*q) * rowWeight;
+}
+
+// Columns [x0, x1) of one source row, a and b as in dot = a*cos(phi - phi') + b
+void accumulateSpan(const Level& level, int row, int x0, int x1, float cosPhi, float sinPhi,
+                    float a, float b, Sums& sums)
+{
+    const Image& source = *level.source;
+    const float rowWeight = level.sinTheta[row];
+    const int offset = row * source.width;
+    int x = x0;
+#ifdef HAS_SIMD_LANES
+    const Lanes::F cp = Lanes::set(cosPhi);
+    const Lanes::F sp = Lanes::set(sinPhi);
+    const Lanes::F la = Lanes::set(a);
+    const Lanes::F lb = Lanes::set(b);
+    const Lanes::F half = Lanes::set(0.5f);
+    const Lanes::F one = Lanes::set(1.f);
+    const Lanes::F zero = Lanes::set(0.f);
+    const Lanes::F a2Minus1 = Lanes::set(level.a2Minus1);
+    const Lanes::F weightScale = Lanes::set(rowWeight);
+    Lanes::F r = zero, g = zero, bl = zero, w = zero;
+    for (; x + Lanes::Width <= x1; x += Lanes::Width) {
+        const Lanes::F cosDelta = Lanes::add(Lanes::mul(cp, Lanes::load(&level.cosPhi[x])),
+                                             Lanes::mul(sp, Lanes::load(&level.sinPhi[x])));
+        const Lanes::F dot = Lanes::add(Lanes::mul(la, cosDelta), lb);
+        const Lanes::F q = Lanes::add(Lanes::mul(Lanes::mul(Lanes::add(one, dot), half), a2Minus1), one);
+        const Lanes::F weight = Lanes::mul(Lanes::div(Lanes::max(dot, zero), Lanes::mul(q, q)), weightScale);
+        r = Lanes::add(r, Lanes::mul(weight, Lanes::load(&source.r[offset + x])));
+        g = Lanes::add(g, Lanes::mul(weight, Lanes::load(&source.g[offset + x])));
+        bl = Lanes::add(bl, Lanes::mul(weight, Lanes::load(&source.b[offset + x])));
+        w = Lanes::add(w, weight);
+    }
+    sums.r += Lanes::sum(r);
+    sums.g += Lanes::sum(g);
+    sums.b += Lanes::sum(bl);
+    sums.weight += Lanes::sum(w);
+#endif
+    for (; x < x1; x++) {
+        const float dot = a * (cosPhi*level.cosPhi[x] + sinPhi*level.sinPhi[x]) + b;
+        const float weight = getWeight(dot, level.a2Minus1, rowWeight);
+        sums.r += weight * source.r[offset + x];
+        sums.g += weight * source.g[offset + x];
+        sums.b += weight * source.b[offset + x];
+        sums.weight += weight;
+    }
+}
+
+Color convolve(const Level& level, float theta, float phi)
+{
+    const Image& source = *level.source;
+    const float alpha = level.windowAngle;
+    const float sinTheta = std::sin(theta);
+    const float cosTheta = std::cos(theta);
+    const int y0 = std::max(static_cast<int>(std::floor((theta - alpha) / PI * source.height)), 0);
+    const int y1 = std::min(static_cast<int>(std::ceil((theta + alpha) / PI * source.height)), source.height);
+
+    // Whole rows when the window reaches a pole
+    int x0 = 0, x1 = source.width;
+    if (theta - alpha > 0.f and theta + alpha < PI and std::sin(alpha) < sinTheta) {
+        const float deltaPhi = std::asin(std::sin(alpha) / sinTheta);
+        x0 = static_cast<int>(std::floor((phi - deltaPhi + PI) / TwoPI * source.width));
+        x1 = static_cast<int>(std::ceil((phi + deltaPhi + PI) / TwoPI * source.width));
+        if (x1 - x0 >= source.width) {
+            x0 = 0;
+            x1 = source.width;
+        }
+    }
+
+    const float cosPhi = std::cos(phi);
+    const float sinPhi = std::sin(phi);
+    Sums sums;
+    for (int y = y0; y < y1; y++) {
+        const float a = sinTheta * level.sinTheta[y];
+        const float b = cosTheta * level.cosTheta[y];
+        // Up to two spans, the window may wrap around in phi
+        if (x0 < 0) {
+            accumulateSpan(level, y, x0 + source.width, source.width, cosPhi, sinPhi, a, b, sums);
+            accumulateSpan(level, y, 0, x1, cosPhi, sinPhi, a, b, sums);
+        }
+        else if (x1 > source.width) {
+            accumulateSpan(level, y, x0, source.width, cosPhi, sinPhi, a, b, sums);
+            accumulateSpan(level, y, 0, x1 - source.width, cosPhi, sinPhi, a, b, sums);
+        }
+        else {
+            accumulateSpan(level, y, x0, x1, cosPhi, sinPhi, a, b, sums);
+        }
+    }
+    const float norm = 1.f / std::max(sums.weight, 1e-20f);
+    return Color{sums.r * norm, sums.g * norm, sums.b * norm};
+}
+
+struct Tile {
+    int level, x0, y0;
+};
+
+// One queue per worker, taken from the front by its owner and stolen from
+// the back by the others. No tiles are added once the workers start.
+class TileQueues {
+public:
+    explicit TileQueues(int numWorkers): queues(numWorkers), mutexes(numWorkers) {}
+
+    void push(int worker, const Tile& tile)
+    {
+        queues[worker].push_back(tile);
+    }
+
+    bool pop(int worker, Tile& tile, int& stolen)
+    {
+        const int numWorkers = static_cast<int>(queues.size());
+        for (int i = 0; i < numWorkers; i++) {
+            const int victim = (worker + i) % numWorkers;
+            std::lock_guard<std::mutex> lock(mutexes[victim]);
+            std::deque<Tile>& queue = queues[victim];
+            if (queue.empty())
+                continue;
+            if (victim == worker) {
+                tile = queue.front();
+                queue.pop_front();
+            }
+            else {
+                tile = queue.back();
+                queue.pop_back();
+                stolen++;
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    std::vector<std::deque<Tile>> queues;
+    std::vector<std::mutex> mutexes;
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <input.hdr> <output.tga>" << std::endl;
+        return 1;
+    }
+
+    Image panorama(0, 0);
+    if (!loadPanorama(argv[1], panorama))
+        return 1;
+    const int width = panorama.width;
+    const int height = panorama.height;
+    if ((height & (height-1)) != 0) {
+        std::cout << "Expected a power of two height!" << std::endl;
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<Image> mips;
+    mips.push_back(std::move(panorama));
+    while (mips.back().height > 8)
+        mips.push_back(downsample(mips.back()));
+
+    // Level 0 is a mirror, a plain resample of the finest mip that
+    // still has at least as many rows
+    std::vector<Level> levels;
+    for (int i = 1; i < Levels; i++)
+        levels.push_back(setupLevel(mips, static_cast<float>(i) / (Levels-1)));
+    int mirrorMip = static_cast<int>(mips.size()) - 1;
+    while (mirrorMip > 0 and mips[mirrorMip].height < LevelHeight)
+        mirrorMip--;
+
+    const int numWorkers = getNumThreads();
+    TileQueues queues(numWorkers);
+    int numTiles = 0;
+    for (int level = 0; level < Levels; level++) {
+        for (int y = 0; y < LevelHeight; y += TileSize) {
+            for (int x = 0; x < LevelWidth; x += TileSize)
+                queues.push(numTiles++ % numWorkers, Tile{level, x, y});
+        }
+    }
+
+    std::vector<u8> atlas(LevelWidth * Levels * LevelHeight * 4);
+    std::atomic<int> stolenTiles(0);
+    auto work = [&](int worker) {
+        Tile tile;
+        int stolen = 0;
+        while (queues.pop(worker, tile, stolen)) {
+            for (int y = tile.y0; y < tile.y0 + TileSize; y++) {
+                const float theta = getTheta(y, LevelHeight);
+                for (int x = tile.x0; x < tile.x0 + TileSize; x++) {
+                    const float phi = getPhi(x, LevelWidth);
+                    const Color color = (tile.level == 0)? samplePanorama(mips[mirrorMip], theta, phi)
+                                                         : convolve(levels[tile.level - 1], theta, phi);
+                    // Rows in texture order, level 0 first
+                    encodeRgbm(color.r, color.g, color.b, &atlas[((tile.level * LevelHeight + y) * LevelWidth + x) * 4]);
+                }
+            }
+        }
+        stolenTiles += stolen;
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numWorkers; i++)
+        threads.push_back(std::thread(work, i));
+    work(0);
+    for (std::thread& thread: threads)
+        thread.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Prefiltered " << width << "x" << height << " into " << Levels << " levels in " << seconds
+              << " s (" << numWorkers << " threads, " << stolenTiles << " of " << numTiles << " tiles stolen)" << std::endl;
+
+    if (!writeTga(argv[2], LevelWidth, Levels * LevelHeight, 4, &atlas[0])) {
+        std::cout << "Failed to write " << argv[2] << "!" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "rgbm.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+struct RgbmTables {
+    float decoded[256];     // pow(i/255, 2.2)
+    float invMultiplier[256]; // pow(i/255, -1/2.2), i > 0
+
+    RgbmTables()
+    {
+        for (int i = 0; i < 256; i++) {
+            decoded[i] = std::pow(i / 255.f, 2.2f);
+            invMultiplier[i] = (i > 0)? std::pow(i / 255.f, -1.f / 2.2f) : 0.f;
+        }
+    }
+};
+
+const RgbmTables tables;
+
+// Multipliers above twice the smallest one only lose precision
+int getLastCandidate(int first)
+{
+    return std::min(2*first + 4, 255);
+}
+
+} // namespace
+
+void encodeRgbm(float r, float g, float b, u8* rgbm)
+{
+    const float linear[3] = {std::max(r, 0.f), std::max(g, 0.f), std::max(b, 0.f)};
+    const float maxChannel = std::max(std::max(linear[0], linear[1]), linear[2]);
+    const int first = std::min(std::max(static_cast<int>(std::ceil(maxChannel / RgbmMaxValue * 255.f)), 1), 255);
+
+    // rgb = pow(linear / (m * max), 1/2.2) = pow(linear / max, 1/2.2) * pow(m, -1/2.2)
+    float base[3];
+    for (int c = 0; c < 3; c++)
+        base[c] = std::pow(linear[c] / RgbmMaxValue, 1.f / 2.2f);
+
+    float bestError = -1.f;
+    for (int m = first; m <= getLastCandidate(first); m++) {
+        const float scale = m / 255.f * RgbmMaxValue;
+        u8 codes[3];
+        float error = 0.f;
+        for (int c = 0; c < 3; c++) {
+            // Rounding happens in gamma space, check both neighbours in linear
+            const float code = std::min(base[c] * tables.invMultiplier[m] * 255.f, 255.f);
+            const int low = static_cast<int>(code);
+            const int high = std::min(low + 1, 255);
+            const float lowError = tables.decoded[low] * scale - linear[c];
+            const float highError = tables.decoded[high] * scale - linear[c];
+            const bool useHigh = highError*highError < lowError*lowError;
+            codes[c] = static_cast<u8>(useHigh ? high : low);
+            error += useHigh ? highError*highError : lowError*lowError;
+        }
+        if (bestError < 0.f or error < bestError) {
+            bestError = error;
+            rgbm[0] = codes[0];
+            rgbm[1] = codes[1];
+            rgbm[2] = codes[2];
+            rgbm[3] = static_cast<u8>(m);
+        }
+    }
+}
+
+void decodeRgbm(const u8* rgbm, float* rgb)
+{
+    const float scale = rgbm[3] / 255.f * RgbmMaxValue;
+    for (int c = 0; c < 3; c++)
+        rgb[c] = tables.decoded[rgbm[c]] * scale;
+}
@@ -0,0 +1,16 @@
+#ifndef __RGBM_HPP__
+#define __RGBM_HPP__
+
+#include "../common.hpp"
+
+// RGBM as decoded by assets/panorama.part and assets/prefiltered.part,
+// linear = pow(rgb, 2.2) * m * RgbmMaxValue. Values above the range clamp.
+const float RgbmMaxValue = 50.f;
+
+// The smallest multiplier that fits isn't always the most accurate once
+// rgb is rounded to 8 bits, so a few larger ones are tried too and the
+// one with the smallest squared error in linear space wins.
+void encodeRgbm(float r, float g, float b, u8* rgbm);
+void decodeRgbm(const u8* rgbm, float* rgb);
+
+#endif
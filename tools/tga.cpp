@@ -0,0 +1,38 @@
+#include "tga.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <cassert>
+#include <vector>
+#include <utility>
+
+bool writeTga(const std::string& filename, int width, int height, int numChannels, const u8* pixels)
+{
+    assert(numChannels == 1 || numChannels == 3 || numChannels == 4);
+    assert(width > 0 && width < 65536 && height > 0 && height < 65536);
+
+    u8 header[18] = {};
+    header[2]  = (numChannels == 1)? 3 : 2; // Uncompressed greyscale / truecolor
+    header[12] = width & 0xff;
+    header[13] = width >> 8;
+    header[14] = height & 0xff;
+    header[15] = height >> 8;
+    header[16] = numChannels * 8;
+    header[17] = 0x20 | ((numChannels == 4)? 8 : 0); // Top-left origin, alpha bits
+
+    // TGA stores BGR(A)
+    std::vector<u8> data(pixels, pixels + width*height*numChannels);
+    if (numChannels >= 3) {
+        for (size_t i = 0; i < data.size(); i += numChannels)
+            std::swap(data[i], data[i+2]);
+    }
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    if (!out) {
+        std::cout << "Failed to write " << filename << "!" << std::endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&data[0]), data.size());
+    return true;
+}
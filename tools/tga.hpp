@@ -0,0 +1,12 @@
+#ifndef __TGA_HPP__
+#define __TGA_HPP__
+
+#include "../common.hpp"
+
+#include <string>
+
+// Uncompressed TGA, 1 (greyscale), 3 (RGB) or 4 (RGBA) channels,
+// rows top to bottom. Readable by stb_image (Renderer::addTexture).
+bool writeTga(const std::string& filename, int width, int height, int numChannels, const u8* pixels);
+
+#endif